@@ -22,23 +22,48 @@ class aabb {
 		point3 min() const { return minimum; }
 		point3 max() const { return maximum; }
         point3 cen() const { return centroid; }
-        bool hit(const ray& r, double t_min, double t_max) const;
+        bool hit(const ray& r, real t_min, real t_max) const;
+
+        // Surface area of the box, the probability measure of the surface area heuristic
+        double surface_area() const {
+            vec3 d = maximum - minimum;
+            return 2 * (d.x() * d.y() + d.x() * d.z() + d.y() * d.z());
+        }
 };
 
-// Check if the ray hit the bounding box by computing t_next in 3 axis
-inline bool aabb::hit(const ray& r, double t_min, double t_max) const {
+// Branchless slab test shared by all acceleration structures. The bounds may be stored in any
+// precision; the ray's sign bits pick the entering and leaving plane of every axis, so there is no
+// swap and no early exit, and the min/max chain compiles to plain min/max instructions.
+// The leaving distances are widened by the rounding bound of the subtraction and multiplication, so
+// rays grazing a box are not lost to rounding in either precision. An origin on a slab plane of an
+// axis the ray is parallel to gives 0 * inf = NaN, which fails both comparisons and leaves the
+// interval unchanged. t_entry receives the distance at which the ray enters the box.
+// Reference: Ize, Robust BVH Ray Traversal
+template <typename Scalar>
+inline bool slab_test(const Scalar box_min[3], const Scalar box_max[3], const ray& r,
+    real t_min, real t_max, real* t_entry = nullptr)
+{
+    const Scalar* planes[2] = { box_min, box_max };
+    const point3& o = r.origin();
+    const vec3& inv = r.inverse_direction();
+    const int* neg = r.dir_is_neg();
+    const real widen = 1 + 2 * rounding_bound(3);
+
     for (int a = 0; a < 3; a++) {
-        auto invD = 1.0f / r.direction()[a];
-        auto t0 = (min()[a] - r.origin()[a]) * invD;
-        auto t1 = (max()[a] - r.origin()[a]) * invD;
-        if (invD < 0.0f)
-            std::swap(t0, t1);
+        real t0 = (planes[neg[a]][a] - o[a]) * inv[a];
+        real t1 = (planes[1 - neg[a]][a] - o[a]) * inv[a] * widen;
         t_min = t0 > t_min ? t0 : t_min;
         t_max = t1 < t_max ? t1 : t_max;
-        if (t_max <= t_min)
-            return false;
     }
-    return true;
+
+    if (t_entry)
+        *t_entry = t_min;
+    return t_min <= t_max;
+}
+
+// Check if the ray hit the bounding box by computing t_next in 3 axis
+inline bool aabb::hit(const ray& r, real t_min, real t_max) const {
+    return slab_test(minimum.e, maximum.e, r, t_min, t_max);
 }
 
 // Return the smallest aabb that contains box0 and box1
@@ -2,19 +2,29 @@
 #define AARECT_H
 
 #include "hittable.h"
+#include "material.h"
 #include "utility.h"
 
+// Solid angle density of sampling a point uniformly on a rectangle, seen at the given squared distance
+// and cosine to the rectangle normal
+inline double rect_pdf(double distance_squared, double cosine, double area) {
+    return cosine > 0 ? distance_squared / (cosine * area) : 0.0;
+}
+
 // Class for rectangle hittable object in xy, yz, zx coordinates
 // Reference: Ray Tracing: The Next Week
-class xy_rect : public hittable {
+class xy_rect final : public hittable {
     public:
-        xy_rect() {}
+        xy_rect() : hittable(primitive_kind::xy_rect) {}
 
         xy_rect(double _x0, double _x1, double _y0, double _y1, double _k,
-            shared_ptr<material> mat)
-            : x0(_x0), x1(_x1), y0(_y0), y1(_y1), k(_k), mp(mat) {};
+            const material* mat)
+            : hittable(primitive_kind::xy_rect), x0(_x0), x1(_x1), y0(_y0), y1(_y1), k(_k), mp(mat) {};
 
-        virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override;
+        virtual bool hit(const ray& r, real t_min, real t_max, hit_record& rec) const override;
+        virtual bool occluded(const ray& r, real t_min, real t_max) const override;
+        virtual double pdf_value(const point3& o, const vec3& v) const override;
+        virtual vec3 random(const point3& o, const sample2& u) const override;
 
         virtual bool bounding_box(double time0, double time1, aabb& output_box) const override {
             // The bounding box must have non-zero width in each dimension, so pad the Z
@@ -23,20 +33,31 @@ class xy_rect : public hittable {
             return true;
         }
 
+        virtual const material* get_material() const override { return mp; }
+        virtual uint64_t scene_key(uint64_t key) const override {
+            key = hittable::scene_key(key);
+            for (real e : { x0, x1, y0, y1, k })
+                key = scene_key_add(key, static_cast<double>(e));
+            return scene_key_add(key, mp);
+        }
+
     public:
-        shared_ptr<material> mp;
-        double x0, x1, y0, y1, k;
+        const material* mp;
+        real x0, x1, y0, y1, k;
 };
 
-class xz_rect : public hittable {
+class xz_rect final : public hittable {
     public:
-        xz_rect() {}
+        xz_rect() : hittable(primitive_kind::xz_rect) {}
 
         xz_rect(double _x0, double _x1, double _z0, double _z1, double _k,
-            shared_ptr<material> mat)
-            : x0(_x0), x1(_x1), z0(_z0), z1(_z1), k(_k), mp(mat) {};
+            const material* mat)
+            : hittable(primitive_kind::xz_rect), x0(_x0), x1(_x1), z0(_z0), z1(_z1), k(_k), mp(mat) {};
 
-        virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override;
+        virtual bool hit(const ray& r, real t_min, real t_max, hit_record& rec) const override;
+        virtual bool occluded(const ray& r, real t_min, real t_max) const override;
+        virtual double pdf_value(const point3& o, const vec3& v) const override;
+        virtual vec3 random(const point3& o, const sample2& u) const override;
 
         virtual bool bounding_box(double time0, double time1, aabb& output_box) const override {
             // The bounding box must have non-zero width in each dimension, so pad the Y
@@ -45,20 +66,31 @@ class xz_rect : public hittable {
             return true;
         }
 
+        virtual const material* get_material() const override { return mp; }
+        virtual uint64_t scene_key(uint64_t key) const override {
+            key = hittable::scene_key(key);
+            for (real e : { x0, x1, z0, z1, k })
+                key = scene_key_add(key, static_cast<double>(e));
+            return scene_key_add(key, mp);
+        }
+
     public:
-        shared_ptr<material> mp;
-        double x0, x1, z0, z1, k;
+        const material* mp;
+        real x0, x1, z0, z1, k;
 };
 
-class yz_rect : public hittable {
+class yz_rect final : public hittable {
     public:
-        yz_rect() {}
+        yz_rect() : hittable(primitive_kind::yz_rect) {}
 
         yz_rect(double _y0, double _y1, double _z0, double _z1, double _k,
-            shared_ptr<material> mat)
-            : y0(_y0), y1(_y1), z0(_z0), z1(_z1), k(_k), mp(mat) {};
+            const material* mat)
+            : hittable(primitive_kind::yz_rect), y0(_y0), y1(_y1), z0(_z0), z1(_z1), k(_k), mp(mat) {};
 
-        virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override;
+        virtual bool hit(const ray& r, real t_min, real t_max, hit_record& rec) const override;
+        virtual bool occluded(const ray& r, real t_min, real t_max) const override;
+        virtual double pdf_value(const point3& o, const vec3& v) const override;
+        virtual vec3 random(const point3& o, const sample2& u) const override;
 
         virtual bool bounding_box(double time0, double time1, aabb& output_box) const override {
             // The bounding box must have non-zero width in each dimension, so pad the X
@@ -67,18 +99,26 @@ class yz_rect : public hittable {
             return true;
         }
 
+        virtual const material* get_material() const override { return mp; }
+        virtual uint64_t scene_key(uint64_t key) const override {
+            key = hittable::scene_key(key);
+            for (real e : { y0, y1, z0, z1, k })
+                key = scene_key_add(key, static_cast<double>(e));
+            return scene_key_add(key, mp);
+        }
+
     public:
-        shared_ptr<material> mp;
-        double y0, y1, z0, z1, k;
+        const material* mp;
+        real y0, y1, z0, z1, k;
 };
 
-bool xy_rect::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
+bool xy_rect::hit(const ray& r, real t_min, real t_max, hit_record& rec) const {
     auto t = (k - r.origin().z()) / r.direction().z();
-    if (t < t_min || t > t_max)
+    if (!(t >= t_min && t <= t_max))
         return false;
     auto x = r.origin().x() + t * r.direction().x();
     auto y = r.origin().y() + t * r.direction().y();
-    if (x < x0 || x > x1 || y < y0 || y > y1)
+    if (!(x >= x0 && x <= x1 && y >= y0 && y <= y1))
         return false;
     rec.u = (x - x0) / (x1 - x0);
     rec.v = (y - y0) / (y1 - y0);
@@ -90,13 +130,22 @@ bool xy_rect::hit(const ray& r, double t_min, double t_max, hit_record& rec) con
     return true;
 }
 
-bool xz_rect::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
+bool xy_rect::occluded(const ray& r, real t_min, real t_max) const {
+    auto t = (k - r.origin().z()) / r.direction().z();
+    if (!(t >= t_min && t <= t_max))
+        return false;
+    auto x = r.origin().x() + t * r.direction().x();
+    auto y = r.origin().y() + t * r.direction().y();
+    return x >= x0 && x <= x1 && y >= y0 && y <= y1;
+}
+
+bool xz_rect::hit(const ray& r, real t_min, real t_max, hit_record& rec) const {
     auto t = (k - r.origin().y()) / r.direction().y();
-    if (t < t_min || t > t_max)
+    if (!(t >= t_min && t <= t_max))
         return false;
     auto x = r.origin().x() + t * r.direction().x();
     auto z = r.origin().z() + t * r.direction().z();
-    if (x < x0 || x > x1 || z < z0 || z > z1)
+    if (!(x >= x0 && x <= x1 && z >= z0 && z <= z1))
         return false;
     rec.u = (x - x0) / (x1 - x0);
     rec.v = (z - z0) / (z1 - z0);
@@ -108,13 +157,22 @@ bool xz_rect::hit(const ray& r, double t_min, double t_max, hit_record& rec) con
     return true;
 }
 
-bool yz_rect::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
+bool xz_rect::occluded(const ray& r, real t_min, real t_max) const {
+    auto t = (k - r.origin().y()) / r.direction().y();
+    if (!(t >= t_min && t <= t_max))
+        return false;
+    auto x = r.origin().x() + t * r.direction().x();
+    auto z = r.origin().z() + t * r.direction().z();
+    return x >= x0 && x <= x1 && z >= z0 && z <= z1;
+}
+
+bool yz_rect::hit(const ray& r, real t_min, real t_max, hit_record& rec) const {
     auto t = (k - r.origin().x()) / r.direction().x();
-    if (t < t_min || t > t_max)
+    if (!(t >= t_min && t <= t_max))
         return false;
     auto y = r.origin().y() + t * r.direction().y();
     auto z = r.origin().z() + t * r.direction().z();
-    if (y < y0 || y > y1 || z < z0 || z > z1)
+    if (!(y >= y0 && y <= y1 && z >= z0 && z <= z1))
         return false;
     rec.u = (y - y0) / (y1 - y0);
     rec.v = (z - z0) / (z1 - z0);
@@ -126,4 +184,46 @@ bool yz_rect::hit(const ray& r, double t_min, double t_max, hit_record& rec) con
     return true;
 }
 
+bool yz_rect::occluded(const ray& r, real t_min, real t_max) const {
+    auto t = (k - r.origin().x()) / r.direction().x();
+    if (!(t >= t_min && t <= t_max))
+        return false;
+    auto y = r.origin().y() + t * r.direction().y();
+    auto z = r.origin().z() + t * r.direction().z();
+    return y >= y0 && y <= y1 && z >= z0 && z <= z1;
+}
+
+double xy_rect::pdf_value(const point3& o, const vec3& v) const {
+    hit_record rec;
+    if (!hit(ray(o, v), 0.001, infinity, rec))
+        return 0.0;
+    return rect_pdf(rec.t * rec.t * v.length_squared(), fabs(v.z()) / v.length(), (x1 - x0) * (y1 - y0));
+}
+
+vec3 xy_rect::random(const point3& o, const sample2& u) const {
+    return point3(x0 + u.u * (x1 - x0), y0 + u.v * (y1 - y0), k) - o;
+}
+
+double xz_rect::pdf_value(const point3& o, const vec3& v) const {
+    hit_record rec;
+    if (!hit(ray(o, v), 0.001, infinity, rec))
+        return 0.0;
+    return rect_pdf(rec.t * rec.t * v.length_squared(), fabs(v.y()) / v.length(), (x1 - x0) * (z1 - z0));
+}
+
+vec3 xz_rect::random(const point3& o, const sample2& u) const {
+    return point3(x0 + u.u * (x1 - x0), k, z0 + u.v * (z1 - z0)) - o;
+}
+
+double yz_rect::pdf_value(const point3& o, const vec3& v) const {
+    hit_record rec;
+    if (!hit(ray(o, v), 0.001, infinity, rec))
+        return 0.0;
+    return rect_pdf(rec.t * rec.t * v.length_squared(), fabs(v.x()) / v.length(), (y1 - y0) * (z1 - z0));
+}
+
+vec3 yz_rect::random(const point3& o, const sample2& u) const {
+    return point3(k, y0 + u.u * (y1 - y0), z0 + u.v * (z1 - z0)) - o;
+}
+
 #endif
\ No newline at end of file
@@ -0,0 +1,183 @@
+#ifndef ADAPTIVE_SAMPLER_H
+#define ADAPTIVE_SAMPLER_H
+
+#include "thread_pool.h"
+#include "tile_renderer.h"
+#include "utility.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <fstream>
+#include <iostream>
+#include <vector>
+
+// Thresholds of the adaptive sampler
+struct adaptive_settings {
+    int min_samples;      // Samples every pixel gets before its error is trusted
+    int max_samples;      // Cap per pixel, so a few fireflies cannot take the whole budget
+    int batch;            // Samples added to an unconverged pixel per round
+    double threshold;     // Target standard error of the pixel mean, relative to the mean
+};
+
+// Running estimate of one pixel. The luminance mean and variance are updated with Welford's method,
+// which stays accurate over thousands of samples without keeping them.
+struct pixel_estimate {
+    color sum;
+    double mean = 0;
+    double m2 = 0;
+    int samples = 0;
+    bool converged = false;
+
+    void add(const color& c) {
+        sum += c;
+        double y = 0.2126 * c.x() + 0.7152 * c.y() + 0.0722 * c.z();
+        samples++;
+        double delta = y - mean;
+        mean += delta / samples;
+        m2 += delta * (y - mean);
+    }
+
+    // Standard error of the mean luminance relative to the mean. Dark pixels are measured against
+    // one output step, so black pixels converge instead of chasing a zero mean.
+    double relative_error() const {
+        if (samples < 2)
+            return infinity;
+        double variance = m2 / (samples - 1);
+        return sqrt(variance / samples) / std::max(mean, 1.0 / 256);
+    }
+};
+
+// Class for spending a sample budget where the image is still noisy.
+// Every pixel first gets min_samples. Then rounds add batch samples to the pixels whose error is above
+// the threshold, until all of them have converged, reached max_samples, or the budget of
+// samples_per_pixel times the pixel count is used up. A pixel stays active while any pixel of its 3x3
+// neighbourhood is, so a pixel whose first samples all missed a small light does not stop on its own.
+// The samples of a pixel are numbered in order, so the image does not depend on the thread count.
+class adaptive_sampler {
+    private:
+        int width;
+        int height;
+        adaptive_settings settings;
+        std::vector<pixel_estimate> pixels;
+
+    public:
+        adaptive_sampler(int w, int h, const adaptive_settings& s)
+            : width(w), height(h), settings(s), pixels(static_cast<size_t>(w) * h) {}
+
+        // Render into fb, which receives the mean of every pixel. trace_samples(samples, count, colors)
+        // traces up to one 4x4 block of pixel samples and writes their colors.
+        template <typename F>
+        void render(thread_pool& pool, const tile_renderer& tiles, framebuffer& fb, int samples_per_pixel, F trace_samples);
+
+        int samples(int x, int y) const { return pixels[static_cast<size_t>(y) * width + x].samples; }
+        double average_samples() const;
+
+        // Sample count of every pixel as a plain PGM image, 255 is max_samples
+        void write_spp_map(std::ofstream& out) const;
+
+    private:
+        pixel_estimate& at(int x, int y) { return pixels[static_cast<size_t>(y) * width + x]; }
+
+        template <typename F>
+        void sample_block(const tile& block, int count, bool all, F& trace_samples);
+
+        size_t update_convergence();
+};
+
+template <typename F>
+void adaptive_sampler::render(thread_pool& pool, const tile_renderer& tiles, framebuffer& fb, int samples_per_pixel, F trace_samples) {
+    for (pixel_estimate& p : pixels)
+        p = pixel_estimate();
+
+    auto for_each_block = [&](int count, bool all) {
+        tiles.for_each_tile(pool, [&](const tile& t) {
+            for (int y = t.y0; y < t.y1; y += 4) {
+                for (int x = t.x0; x < t.x1; x += 4) {
+                    tile block = { x, y, std::min(x + 4, t.x1), std::min(y + 4, t.y1) };
+                    sample_block(block, count, all, trace_samples);
+                }
+            }
+        });
+    };
+
+    int64_t budget = static_cast<int64_t>(pixels.size()) * samples_per_pixel;
+    int first = std::min(settings.min_samples, settings.max_samples);
+    for_each_block(first, true);
+    budget -= static_cast<int64_t>(pixels.size()) * first;
+
+    int rounds = 0;
+    for (size_t active = update_convergence(); active > 0 && budget > 0; active = update_convergence()) {
+        int count = static_cast<int>(std::min<int64_t>(settings.batch, budget / static_cast<int64_t>(active)));
+        if (count == 0)
+            break;
+        for_each_block(count, false);
+        budget -= static_cast<int64_t>(active) * count;
+        rounds++;
+    }
+    std::cerr << "\nAdaptive rounds: " << rounds << ", average samples per pixel: " << average_samples() << std::endl;
+
+    for (int y = 0; y < height; y++)
+        for (int x = 0; x < width; x++)
+            fb.at(x, y) = at(x, y).sum / at(x, y).samples;
+}
+
+// Add count samples to the pixels of block that are still active, or to all of them
+template <typename F>
+void adaptive_sampler::sample_block(const tile& block, int count, bool all, F& trace_samples) {
+    pixel_sample batch[16];
+    color colors[16];
+    for (int s = 0; s < count; s++) {
+        int n = 0;
+        for (int y = block.y0; y < block.y1; y++) {
+            for (int x = block.x0; x < block.x1; x++) {
+                const pixel_estimate& p = at(x, y);
+                if (all || (!p.converged && p.samples < settings.max_samples))
+                    batch[n++] = { x, height - 1 - y, static_cast<uint32_t>(p.samples) };
+            }
+        }
+        if (n == 0)
+            return;
+
+        trace_samples(batch, n, colors);
+        for (int k = 0; k < n; k++)
+            at(batch[k].i, height - 1 - batch[k].j).add(colors[k]);
+    }
+}
+
+// Mark converged pixels and count the samples the next round takes per batch step
+inline size_t adaptive_sampler::update_convergence() {
+    std::vector<uint8_t> noisy(pixels.size());
+    for (size_t k = 0; k < pixels.size(); k++)
+        noisy[k] = pixels[k].relative_error() > settings.threshold;
+
+    size_t active = 0;
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            bool any = false;
+            for (int ny = std::max(y - 1, 0); ny <= std::min(y + 1, height - 1) && !any; ny++)
+                for (int nx = std::max(x - 1, 0); nx <= std::min(x + 1, width - 1) && !any; nx++)
+                    any = noisy[static_cast<size_t>(ny) * width + nx] != 0;
+
+            pixel_estimate& p = at(x, y);
+            p.converged = !any;
+            if (!p.converged && p.samples < settings.max_samples)
+                active++;
+        }
+    }
+    return active;
+}
+
+inline double adaptive_sampler::average_samples() const {
+    double total = 0;
+    for (const pixel_estimate& p : pixels)
+        total += p.samples;
+    return pixels.empty() ? 0 : total / pixels.size();
+}
+
+inline void adaptive_sampler::write_spp_map(std::ofstream& out) const {
+    out << "P2\n" << width << ' ' << height << "\n255\n";
+    for (const pixel_estimate& p : pixels)
+        out << p.samples * 255 / std::max(settings.max_samples, 1) << '\n';
+}
+
+#endif
@@ -1,50 +1,87 @@
 #ifndef BVH_H
 #define BVH_H
 
+#include "bvh_build.h"
+#include "dispatch.h"
 #include "hittable.h"
 #include "hittable_list.h"
 #include "utility.h"
 
 #include <algorithm>
+#include <memory>
 
-// Class for bounding volume hierarchies. It constructs the bvh tree upon initialization using middle point method.
+// Class for bounding volume hierarchies. It constructs the bvh tree upon initialization using the binned surface area heuristic.
 // Reference: Ray Tracing: The Next Week, Physically Based Rendering
-class bvh_node : public hittable {
+class bvh_node final : public hittable {
 public:
-    bvh_node();
+    bvh_node() : hittable(primitive_kind::bvh_node) {}
 
     bvh_node(const hittable_list& list, double time0, double time1)
         : bvh_node(list.objects, 0, list.objects.size(), time0, time1, 0)
     {}
 
     bvh_node(
-        const std::vector<shared_ptr<hittable>>& src_objects,
+        const std::vector<hittable*>& src_objects,
         size_t start, size_t end, double time0, double time1, int depth);
 
     virtual bool hit(
-        const ray& r, double t_min, double t_max, hit_record& rec) const override;
+        const ray& r, real t_min, real t_max, hit_record& rec) const override;
+
+    virtual bool occluded(const ray& r, real t_min, real t_max) const override;
+
+    virtual bool find_occluder(const ray& r, real t_min, real t_max, occluder_hint& hint) const override;
 
     virtual bool bounding_box(double time0, double time1, aabb& output_box) const override;
 
+    virtual uint64_t scene_key(uint64_t key) const override {
+        return right->scene_key(left->scene_key(key));
+    }
+
+private:
+    void build(thread_pool& pool, const std::vector<hittable*>& objects, const std::vector<aabb>& boxes,
+        uint32_t* first, uint32_t* last);
+
 public:
-    shared_ptr<hittable> left;
-    shared_ptr<hittable> right;
+    // Children are either objects of the scene or inner nodes owned by this node
+    const hittable* left = nullptr;
+    const hittable* right = nullptr;
+    std::unique_ptr<bvh_node> left_node;
+    std::unique_ptr<bvh_node> right_node;
     aabb box;
 };
 
 // Traverse through the bvh tree to find the hit point and update hit record
-bool bvh_node::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
+bool bvh_node::hit(const ray& r, real t_min, real t_max, hit_record& rec) const {
     // If ray does not hit the box, it must not hit its children
     if (!box.hit(r, t_min, t_max))
         return false;
 
-    // Traverse through children to check for hit
-    bool hit_left = left->hit(r, t_min, t_max, rec);
-    bool hit_right = right->hit(r, t_min, hit_left ? rec.t : t_max, rec);
+    // Traverse through children to check for hit, inner nodes without a virtual call
+    bool hit_left = left_node ? left_node->bvh_node::hit(r, t_min, t_max, rec) : dispatch_hit(*left, r, t_min, t_max, rec);
+    real t_right = hit_left ? rec.t : t_max;
+    bool hit_right = right_node ? right_node->bvh_node::hit(r, t_min, t_right, rec) : dispatch_hit(*right, r, t_min, t_right, rec);
 
     return hit_left || hit_right;
 }
 
+// Any hit ends the search, the right subtree is skipped if the left one is blocked
+bool bvh_node::occluded(const ray& r, real t_min, real t_max) const {
+    if (!box.hit(r, t_min, t_max))
+        return false;
+    if (left_node ? left_node->bvh_node::occluded(r, t_min, t_max) : dispatch_occluded(*left, r, t_min, t_max))
+        return true;
+    return right_node ? right_node->bvh_node::occluded(r, t_min, t_max) : dispatch_occluded(*right, r, t_min, t_max);
+}
+
+bool bvh_node::find_occluder(const ray& r, real t_min, real t_max, occluder_hint& hint) const {
+    if (!box.hit(r, t_min, t_max))
+        return false;
+    if (left_node ? left_node->bvh_node::find_occluder(r, t_min, t_max, hint) : dispatch_find_occluder(*left, r, t_min, t_max, hint))
+        return true;
+    return right_node ? right_node->bvh_node::find_occluder(r, t_min, t_max, hint)
+        : dispatch_find_occluder(*right, r, t_min, t_max, hint);
+}
+
 bool bvh_node::bounding_box(double time0, double time1, aabb& output_box) const {
     output_box = box;
     return true;
@@ -52,72 +89,64 @@ bool bvh_node::bounding_box(double time0, double time1, aabb& output_box) const
 
 // Construct bvh tree upon initialization
 bvh_node::bvh_node(
-    const std::vector<shared_ptr<hittable>>& src_objects,
-        size_t start, size_t end, double time0, double time1, int depth) 
+    const std::vector<hittable*>& src_objects,
+        size_t start, size_t end, double time0, double time1, int depth)
+    : hittable(primitive_kind::bvh_node)
 {
-    // Create a modifiable array of the source scene objects
-    std::vector<shared_ptr<hittable>> objects = src_objects;
-
-    int axis = 0;
-    double max_range = 0;
-    double middle_point = 0;
-    // Iterate through all the bounding boxes in the current root
-    for (int i = 0; i < 3; i++) {
-        double cen_i_min = db_max;
-        double cen_i_max = -db_max;
-        for (int j = start; j < end; j++) {
-            aabb temp_box;
-            if (objects[j]->bounding_box(time0, time1, temp_box)) {
-                if (temp_box.cen().e[i] < cen_i_min) cen_i_min = temp_box.cen().e[i];
-                if (temp_box.cen().e[i] > cen_i_max) cen_i_max = temp_box.cen().e[i];
-            }
-        }
-        // Find that largest gap between the centroids among the axis and set it as separating axis
-        // Update middle point for partition algorithm
-        if (cen_i_max - cen_i_min > max_range) {
-            max_range = cen_i_max - cen_i_min;
-            middle_point = (cen_i_max + cen_i_min) / 2;
-            axis = i;
-        }
+    // Query every bounding box once, the build only moves indices into src_objects around
+    std::vector<aabb> boxes(src_objects.size());
+    std::vector<uint32_t> indices;
+    for (size_t i = start; i < end; i++) {
+        if (!src_objects[i]->bounding_box(time0, time1, boxes[i]))
+            std::cerr << "No bounding box in bvh_node constructor.\n";
+        indices.push_back(static_cast<uint32_t>(i));
     }
 
-    size_t object_span = end - start;
+    build(thread_pool::global(), src_objects, boxes, indices.data(), indices.data() + indices.size());
+}
+
+// Recursively split the index range with the binned surface area heuristic, building large subtrees in parallel
+void bvh_node::build(thread_pool& pool, const std::vector<hittable*>& objects, const std::vector<aabb>& boxes,
+    uint32_t* first, uint32_t* last)
+{
+    aabb centroid_box;
+    build_range_bounds(pool, boxes, first, last, box, centroid_box);
+
+    size_t object_span = last - first;
 
     // If 1 box in current root, set both leaf node to the object
     if (object_span == 1) {
-        left = right = objects[start];
+        left = right = objects[first[0]];
     }
 
     // If 2 boxes in current root, each leaf node contains 1 object
     else if (object_span == 2) {
-        left = objects[start];
-        right = objects[start + 1];
+        left = objects[first[0]];
+        right = objects[first[1]];
     }
-    // If more than 2 boxes in current root, partition based on middle point
+    // If more than 2 boxes in current root, partition at the cheapest split
     else {
-        // Find iterator among the object vector that partition based on middle point
-        auto it = std::partition(objects.begin() + start, objects.begin() + end, 
-            [axis, middle_point](const shared_ptr<hittable> a) {
-                aabb box_a;
-                if (a->bounding_box(0, 1, box_a))
-                    return box_a.cen().e[axis] < middle_point;
-            });
+        sah_split split = build_find_sah_split(pool, boxes, first, last, box, centroid_box);
+        uint32_t* mid = split.axis >= 0
+            ? build_partition_sah(pool, boxes, first, last, centroid_box, split)
+            : partition_equal_counts(boxes, first, last, 0);
 
         // Recursively construct children of bvh tree
-        auto mid = it - objects.begin();
-        left = make_shared<bvh_node>(objects, start, mid, time0, time1, depth + 1);
-        right = make_shared<bvh_node>(objects, mid, end, time0, time1, depth + 1);
+        left_node.reset(new bvh_node());
+        right_node.reset(new bvh_node());
+        if (object_span > parallel_subtree_threshold) {
+            task_group group(pool);
+            group.run([&]() { left_node->build(pool, objects, boxes, first, mid); });
+            right_node->build(pool, objects, boxes, mid, last);
+            group.wait();
+        }
+        else {
+            left_node->build(pool, objects, boxes, first, mid);
+            right_node->build(pool, objects, boxes, mid, last);
+        }
+        left = left_node.get();
+        right = right_node.get();
     }
-
-    aabb box_left, box_right;
-
-    if (!left->bounding_box(time0, time1, box_left)
-        || !right->bounding_box(time0, time1, box_right)
-        )
-        std::cerr << "No bounding box in bvh_node constructor.\n";
-
-    // Box the current bvh root contains boxes of both children
-    box = surrounding_box(box_left, box_right);
 }
 
 #endif
\ No newline at end of file
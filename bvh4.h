@@ -0,0 +1,642 @@
+#ifndef BVH4_H
+#define BVH4_H
+
+#include "dispatch.h"
+#include "flat_bvh.h"
+#include "hittable.h"
+#include "hittable_list.h"
+#include "ray_packet.h"
+#include "utility.h"
+
+#include <cstdint>
+#include <vector>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define BVH4_SSE
+#include <emmintrin.h>
+#endif
+
+// Node of the 4-wide bvh. The boxes of all four children are stored per coordinate (structure of
+// arrays) so one ray is tested against the four of them with a single SSE slab test.
+// A child with count 0 is an interior node at index child, count > 0 is a leaf with count primitives
+// starting at child, and child -1 is an empty slot.
+struct alignas(16) bvh4_node {
+    float min_x[4], min_y[4], min_z[4];
+    float max_x[4], max_y[4], max_z[4];
+    int32_t child[4];
+    uint16_t count[4];
+    uint8_t pad[8];
+};
+
+static_assert(sizeof(bvh4_node) == 128, "bvh4_node must span exactly two cache lines");
+
+// Entries of the traversal stacks. A wide node lies at least one binary level below its parent, so the
+// wide tree is no deeper than the flat_bvh it is collapsed from, and every level popped pushes at most
+// three more entries than it takes.
+const int bvh4_stack_size = 3 * flat_bvh_max_depth + 1;
+
+// Class for a 4-wide bvh collapsed from the binary flat_bvh. Every node absorbs the largest
+// interior grandchildren until it has four children, which cuts the depth of the tree in half.
+// Reference: Dammertz et al., Shallow Bounding Volume Hierarchies for Fast SIMD Ray Tracing
+class bvh4 {
+    public:
+        std::vector<bvh4_node> nodes;
+        std::vector<uint32_t> primitive_indices;
+
+    public:
+        bvh4() {}
+        bvh4(const flat_bvh& tree) {
+            primitive_indices.assign(tree.primitive_indices.begin(), tree.primitive_indices.end());
+            if (!tree.nodes.empty())
+                collapse(tree, 0);
+        }
+
+        bool empty() const { return nodes.empty(); }
+
+        // Find the closest hit, same contract as flat_bvh::intersect
+        template <typename F>
+        bool intersect(const ray& r, real t_min, real t_max, F&& hit_primitive) const;
+
+        // Find any hit, same contract as flat_bvh::occluded
+        template <typename F>
+        bool occluded(const ray& r, real t_min, real t_max, F&& occludes) const;
+
+        // Find the closest hit of every ray in a packet. hit_primitive(k, index, t_min, t_max) tests
+        // ray k against one primitive and shrinks t_max[k] on a hit.
+        template <typename F>
+        void intersect_packet(const ray_packet& packet, real t_min, real t_max[], F&& hit_primitive) const;
+
+    private:
+        // Single ray in the precision of the node boxes. pad is the absolute slack of its slab
+        // distances, see slab_pad.
+        struct ray_data {
+            float orig[3];
+            float inv_dir[3];
+            float pad;
+
+            ray_data() {}
+            ray_data(const ray& r) {
+                for (int a = 0; a < 3; a++) {
+                    orig[a] = static_cast<float>(r.origin()[a]);
+                    inv_dir[a] = static_cast<float>(r.inverse_direction()[a]);
+                }
+                pad = slab_pad(orig, orig, inv_dir, inv_dir);
+            }
+        };
+
+        // Stack entry: a child reference, the entry distance and, for packets, the rays still alive
+        struct entry {
+            int32_t child;
+            uint16_t count;
+            uint16_t ray_mask;
+            float t_near;
+        };
+
+        // Packets narrower than this leave the packet traversal and continue ray by ray
+        static const int min_packet_rays = 2;
+
+        template <typename F>
+        bool traverse(const ray_data& rd, entry root, real t_min, real& t_max, F&& hit_primitive) const;
+
+        int32_t collapse(const flat_bvh& tree, uint32_t index);
+
+        // Rounding error of (plane - origin) * inverse direction that does not shrink with the distance:
+        // the origin and the planes near it are only known to an ulp of the origin's magnitude. Rays far
+        // from the scene origin need it on top of the relative widening of the t interval.
+        static float slab_pad(const float orig_lo[3], const float orig_hi[3], const float inv_lo[3], const float inv_hi[3]);
+
+        // Test the four children against the ray, returns a bit mask of the hit children
+        static int hit_children(const bvh4_node& node, const float orig[3], const float inv_dir[3],
+            float t_min, float t_max, float pad, float t_near[4]);
+
+        // Interval test of the four children against a packet, see packet_bounds::classify.
+        // Returns the mask of children hit by some ray, all_mask receives the ones hit by every ray.
+        static int classify_children(const bvh4_node& node, const packet_bounds& bounds,
+            float t_min, float t_max_lo, float t_max_hi, float pad, float t_near[4], int& all_mask);
+};
+
+int32_t bvh4::collapse(const flat_bvh& tree, uint32_t index) {
+    auto area = [&](uint32_t n) {
+        const linear_bvh_node& b = tree.nodes[n];
+        float dx = b.box_max[0] - b.box_min[0], dy = b.box_max[1] - b.box_min[1], dz = b.box_max[2] - b.box_min[2];
+        return dx * dy + dx * dz + dy * dz;
+    };
+
+    // Gather up to four binary nodes below this one, opening the largest interior node each time
+    uint32_t children[4];
+    int child_count = 0;
+    const linear_bvh_node& root = tree.nodes[index];
+    if (root.is_leaf())
+        children[child_count++] = index;
+    else {
+        children[child_count++] = index + 1;
+        children[child_count++] = root.second_child;
+    }
+
+    while (child_count < 4) {
+        int best = -1;
+        for (int i = 0; i < child_count; i++) {
+            if (!tree.nodes[children[i]].is_leaf() && (best < 0 || area(children[i]) > area(children[best])))
+                best = i;
+        }
+        if (best < 0)
+            break;
+        uint32_t opened = children[best];
+        children[best] = opened + 1;
+        children[child_count++] = tree.nodes[opened].second_child;
+    }
+
+    int32_t offset = static_cast<int32_t>(nodes.size());
+    nodes.emplace_back();
+    for (int i = 0; i < 4; i++) {
+        bvh4_node& node = nodes[offset];
+        if (i >= child_count) {
+            // Empty slot with an inverted box that no ray can hit
+            node.min_x[i] = node.min_y[i] = node.min_z[i] = std::numeric_limits<float>::infinity();
+            node.max_x[i] = node.max_y[i] = node.max_z[i] = -std::numeric_limits<float>::infinity();
+            node.child[i] = -1;
+            node.count[i] = 0;
+            continue;
+        }
+
+        const linear_bvh_node& b = tree.nodes[children[i]];
+        node.min_x[i] = b.box_min[0]; node.min_y[i] = b.box_min[1]; node.min_z[i] = b.box_min[2];
+        node.max_x[i] = b.box_max[0]; node.max_y[i] = b.box_max[1]; node.max_z[i] = b.box_max[2];
+        if (b.is_leaf()) {
+            node.child[i] = static_cast<int32_t>(b.first_primitive);
+            node.count[i] = b.count;
+        }
+        else {
+            int32_t child = collapse(tree, children[i]);
+            nodes[offset].child[i] = child;
+            nodes[offset].count[i] = 0;
+        }
+    }
+    for (int i = 0; i < 8; i++)
+        nodes[offset].pad[i] = 0;
+
+    return offset;
+}
+
+// Float rounding of the ray may move the slabs by a few ulps, widen the interval to stay conservative
+const float bvh4_widen_slack = 4 * std::numeric_limits<float>::epsilon();
+const float bvh4_widen = 1.0f + bvh4_widen_slack;
+
+inline float bvh4::slab_pad(const float orig_lo[3], const float orig_hi[3], const float inv_lo[3], const float inv_hi[3]) {
+    // Axes with an infinite reciprocal have no rounding to cover, their slabs are all or nothing
+    float pad = 0;
+    for (int a = 0; a < 3; a++) {
+        float inv = std::max(std::fabs(inv_lo[a]), std::fabs(inv_hi[a]));
+        if (inv < std::numeric_limits<float>::infinity())
+            pad = std::max(pad, std::max(std::fabs(orig_lo[a]), std::fabs(orig_hi[a])) * inv);
+    }
+    return 2 * bvh4_widen_slack * pad;
+}
+
+inline int bvh4::hit_children(const bvh4_node& node, const float orig[3], const float inv_dir[3],
+    float t_min, float t_max, float pad, float t_near[4])
+{
+#ifdef BVH4_SSE
+    __m128 ox = _mm_set1_ps(orig[0]), oy = _mm_set1_ps(orig[1]), oz = _mm_set1_ps(orig[2]);
+    __m128 ix = _mm_set1_ps(inv_dir[0]), iy = _mm_set1_ps(inv_dir[1]), iz = _mm_set1_ps(inv_dir[2]);
+
+    __m128 tx0 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.min_x), ox), ix);
+    __m128 tx1 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.max_x), ox), ix);
+    __m128 ty0 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.min_y), oy), iy);
+    __m128 ty1 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.max_y), oy), iy);
+    __m128 tz0 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.min_z), oz), iz);
+    __m128 tz1 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.max_z), oz), iz);
+
+    __m128 near = _mm_max_ps(_mm_max_ps(_mm_min_ps(tx0, tx1), _mm_min_ps(ty0, ty1)),
+        _mm_max_ps(_mm_min_ps(tz0, tz1), _mm_set1_ps(t_min)));
+    __m128 far = _mm_min_ps(_mm_min_ps(_mm_max_ps(tx0, tx1), _mm_max_ps(ty0, ty1)),
+        _mm_min_ps(_mm_max_ps(tz0, tz1), _mm_set1_ps(t_max)));
+
+    _mm_storeu_ps(t_near, near);
+    return _mm_movemask_ps(_mm_cmple_ps(near, _mm_add_ps(far, _mm_set1_ps(pad))));
+#else
+    const float* lo[3] = { node.min_x, node.min_y, node.min_z };
+    const float* hi[3] = { node.max_x, node.max_y, node.max_z };
+    int mask = 0;
+    for (int i = 0; i < 4; i++) {
+        float near = t_min, far = t_max;
+        for (int a = 0; a < 3; a++) {
+            float t0 = (lo[a][i] - orig[a]) * inv_dir[a];
+            float t1 = (hi[a][i] - orig[a]) * inv_dir[a];
+            near = std::max(near, std::min(t0, t1));
+            far = std::min(far, std::max(t0, t1));
+        }
+        t_near[i] = near;
+        if (near <= far + pad)
+            mask |= 1 << i;
+    }
+    return mask;
+#endif
+}
+
+#ifdef BVH4_SSE
+// Lower and upper bound of [a, b] * [c, d] for four intervals at once
+inline void interval_mul4(__m128 a, __m128 b, __m128 c, __m128 d, __m128& lo, __m128& hi) {
+    __m128 p0 = _mm_mul_ps(a, c), p1 = _mm_mul_ps(a, d), p2 = _mm_mul_ps(b, c), p3 = _mm_mul_ps(b, d);
+    lo = _mm_min_ps(_mm_min_ps(p0, p1), _mm_min_ps(p2, p3));
+    hi = _mm_max_ps(_mm_max_ps(p0, p1), _mm_max_ps(p2, p3));
+}
+#endif
+
+inline int bvh4::classify_children(const bvh4_node& node, const packet_bounds& bounds,
+    float t_min, float t_max_lo, float t_max_hi, float pad, float t_near[4], int& all_mask)
+{
+#ifdef BVH4_SSE
+    const float* lo_planes[3] = { node.min_x, node.min_y, node.min_z };
+    const float* hi_planes[3] = { node.max_x, node.max_y, node.max_z };
+    __m128 near_lo = _mm_set1_ps(t_min), near_hi = near_lo;
+    __m128 far_lo = _mm_set1_ps(t_max_lo), far_hi = _mm_set1_ps(t_max_hi);
+    for (int a = 0; a < 3; a++) {
+        __m128 o_lo = _mm_set1_ps(bounds.orig_lo[a]), o_hi = _mm_set1_ps(bounds.orig_hi[a]);
+        __m128 i_lo = _mm_set1_ps(bounds.inv_lo[a]), i_hi = _mm_set1_ps(bounds.inv_hi[a]);
+        __m128 p0 = _mm_load_ps(lo_planes[a]), p1 = _mm_load_ps(hi_planes[a]);
+        __m128 lo0, hi0, lo1, hi1;
+        interval_mul4(_mm_sub_ps(p0, o_hi), _mm_sub_ps(p0, o_lo), i_lo, i_hi, lo0, hi0);
+        interval_mul4(_mm_sub_ps(p1, o_hi), _mm_sub_ps(p1, o_lo), i_lo, i_hi, lo1, hi1);
+        if (bounds.inv_lo[a] < 0) {
+            std::swap(lo0, lo1);
+            std::swap(hi0, hi1);
+        }
+        near_lo = _mm_max_ps(near_lo, lo0);
+        near_hi = _mm_max_ps(near_hi, hi0);
+        far_lo = _mm_min_ps(far_lo, lo1);
+        far_hi = _mm_min_ps(far_hi, hi1);
+    }
+    _mm_storeu_ps(t_near, near_lo);
+
+    // Leave room for the rounding of the interval products
+    __m128 widen = _mm_set1_ps(bvh4_widen_slack);
+    __m128 sign = _mm_set1_ps(-0.0f);
+    __m128 half_pad = _mm_set1_ps(0.5f * pad);
+    auto grow = [&](__m128 x) { return _mm_add_ps(_mm_add_ps(x, _mm_mul_ps(widen, _mm_andnot_ps(sign, x))), half_pad); };
+    auto shrink = [&](__m128 x) { return _mm_sub_ps(_mm_sub_ps(x, _mm_mul_ps(widen, _mm_andnot_ps(sign, x))), half_pad); };
+    int some = _mm_movemask_ps(_mm_cmple_ps(shrink(near_lo), grow(far_hi)));
+    all_mask = _mm_movemask_ps(_mm_cmple_ps(grow(near_hi), shrink(far_lo))) & some;
+    return some;
+#else
+    int some = 0;
+    all_mask = 0;
+    for (int i = 0; i < 4; i++) {
+        float lo[3] = { node.min_x[i], node.min_y[i], node.min_z[i] };
+        float hi[3] = { node.max_x[i], node.max_y[i], node.max_z[i] };
+        packet_bounds::coverage c = bounds.classify(lo, hi, t_min, t_max_lo, t_max_hi, pad, t_near[i]);
+        if (c != packet_bounds::miss_all)
+            some |= 1 << i;
+        if (c == packet_bounds::hit_all)
+            all_mask |= 1 << i;
+    }
+    return some;
+#endif
+}
+
+
+template <typename F>
+bool bvh4::intersect(const ray& r, real t_min, real t_max, F&& hit_primitive) const {
+    if (nodes.empty())
+        return false;
+    entry root = { 0, 0, 0, static_cast<float>(t_min) };
+    return traverse(ray_data(r), root, t_min, t_max, hit_primitive);
+}
+
+// Iterative traversal: all four children are tested at once and the hit ones are pushed far to near,
+// so the nearest child is visited first and entries behind the closest hit are skipped when popped
+template <typename F>
+bool bvh4::traverse(const ray_data& rd, entry root, real t_min, real& t_max, F&& hit_primitive) const {
+    entry stack[bvh4_stack_size];
+    int stack_size = 0;
+    stack[stack_size++] = root;
+
+    bool hit_anything = false;
+    while (stack_size > 0) {
+        entry e = stack[--stack_size];
+        if (e.t_near > t_max * bvh4_widen + rd.pad)
+            continue;
+
+        if (e.count > 0) {
+            for (uint32_t i = 0; i < e.count; i++) {
+                if (hit_primitive(primitive_indices[e.child + i], t_min, t_max))
+                    hit_anything = true;
+            }
+            continue;
+        }
+
+        const bvh4_node& node = nodes[e.child];
+        float t_near[4];
+        int mask = hit_children(node, rd.orig, rd.inv_dir, static_cast<float>(t_min) / bvh4_widen,
+            static_cast<float>(t_max) * bvh4_widen, rd.pad, t_near);
+
+        // Sort the hit children by distance, then push the farthest first
+        entry hits[4];
+        int hit_count = 0;
+        for (int i = 0; i < 4; i++) {
+            if (!(mask & (1 << i)) || node.child[i] < 0)
+                continue;
+            entry h = { node.child[i], node.count[i], 0, t_near[i] };
+            int k = hit_count++;
+            while (k > 0 && hits[k - 1].t_near < h.t_near) {
+                hits[k] = hits[k - 1];
+                k--;
+            }
+            hits[k] = h;
+        }
+        for (int i = 0; i < hit_count; i++)
+            stack[stack_size++] = hits[i];
+    }
+
+    return hit_anything;
+}
+
+// Any-hit traversal: children are pushed in node order without sorting, the first occluding
+// primitive ends the search
+template <typename F>
+bool bvh4::occluded(const ray& r, real t_min, real t_max, F&& occludes) const {
+    if (nodes.empty())
+        return false;
+
+    ray_data rd(r);
+    entry stack[bvh4_stack_size];
+    int stack_size = 0;
+    stack[stack_size++] = { 0, 0, 0, static_cast<float>(t_min) };
+
+    while (stack_size > 0) {
+        entry e = stack[--stack_size];
+        if (e.count > 0) {
+            for (uint32_t i = 0; i < e.count; i++) {
+                if (occludes(primitive_indices[e.child + i]))
+                    return true;
+            }
+            continue;
+        }
+
+        const bvh4_node& node = nodes[e.child];
+        float t_near[4];
+        int mask = hit_children(node, rd.orig, rd.inv_dir, static_cast<float>(t_min) / bvh4_widen,
+            static_cast<float>(t_max) * bvh4_widen, rd.pad, t_near);
+        for (int i = 0; i < 4; i++) {
+            if ((mask & (1 << i)) && node.child[i] >= 0)
+                stack[stack_size++] = { node.child[i], node.count[i], 0, t_near[i] };
+        }
+    }
+
+    return false;
+}
+
+// Packet traversal: a node is fetched once for all rays still alive in its subtree. Interval culling
+// first rejects children for the whole packet, then the surviving children are tested ray by ray to
+// narrow the masks. A subtree reached by fewer than min_packet_rays rays, or a packet whose rays
+// diverge in direction, falls back to single ray traversal.
+template <typename F>
+void bvh4::intersect_packet(const ray_packet& packet, real t_min, real t_max[], F&& hit_primitive) const {
+    if (nodes.empty() || packet.size == 0)
+        return;
+
+    ray_data rays[ray_packet::max_size];
+    for (int k = 0; k < packet.size; k++)
+        rays[k] = ray_data(packet.rays[k]);
+
+    // Incoherent packet, trace ray by ray
+    if (packet.size < min_packet_rays || !packet.same_direction_signs()) {
+        entry root = { 0, 0, 0, static_cast<float>(t_min) };
+        for (int k = 0; k < packet.size; k++) {
+            traverse(rays[k], root, t_min, t_max[k],
+                [&](uint32_t index, real t0, real& t1) { return hit_primitive(k, index, t0, t1); });
+        }
+        return;
+    }
+
+    packet_bounds bounds(packet);
+    float t_lo = static_cast<float>(t_min) / bvh4_widen;
+    float pad = slab_pad(bounds.orig_lo, bounds.orig_hi, bounds.inv_lo, bounds.inv_hi);
+
+    entry stack[bvh4_stack_size];
+    int stack_size = 0;
+    stack[stack_size++] = { 0, 0, static_cast<uint16_t>((1u << packet.size) - 1), static_cast<float>(t_min) };
+
+    while (stack_size > 0) {
+        entry e = stack[--stack_size];
+
+        // Closest and farthest hit so far of the rays in the entry, nothing behind the farthest can matter
+        real t_far = 0, t_close = infinity;
+        for (int k = 0; k < packet.size; k++) {
+            if (e.ray_mask & (1u << k)) {
+                t_far = std::max(t_far, t_max[k]);
+                t_close = std::min(t_close, t_max[k]);
+            }
+        }
+        if (e.t_near > t_far * bvh4_widen + pad)
+            continue;
+
+        if (e.count > 0) {
+            for (int k = 0; k < packet.size; k++) {
+                if (!(e.ray_mask & (1u << k)))
+                    continue;
+                for (uint32_t i = 0; i < e.count; i++)
+                    hit_primitive(k, primitive_indices[e.child + i], t_min, t_max[k]);
+            }
+            continue;
+        }
+
+        const bvh4_node& node = nodes[e.child];
+        float t_hi = static_cast<float>(t_far) * bvh4_widen;
+
+        // Interval test of the four children against the whole packet: children missed by every ray
+        // are dropped and children hit by every ray keep the full mask without testing single rays
+        uint16_t child_mask[4] = { 0, 0, 0, 0 };
+        float child_near[4];
+        int all_mask;
+        int some_mask = classify_children(node, bounds, t_lo, static_cast<float>(t_close), t_hi, pad, child_near, all_mask);
+        bool partial[4];
+        bool any_partial = false;
+        for (int i = 0; i < 4; i++) {
+            partial[i] = false;
+            if (node.child[i] < 0 || !(some_mask & (1 << i)))
+                continue;
+            if (all_mask & (1 << i))
+                child_mask[i] = e.ray_mask;
+            else {
+                partial[i] = true;
+                any_partial = true;
+                child_near[i] = infinity;
+            }
+        }
+
+        // Exact tests of the undecided children, one ray at a time
+        for (int k = 0; any_partial && k < packet.size; k++) {
+            if (!(e.ray_mask & (1u << k)))
+                continue;
+            float t_near[4];
+            int mask = hit_children(node, rays[k].orig, rays[k].inv_dir, t_lo,
+                static_cast<float>(t_max[k]) * bvh4_widen, rays[k].pad, t_near);
+            for (int i = 0; i < 4; i++) {
+                if (partial[i] && (mask & (1 << i))) {
+                    child_mask[i] |= static_cast<uint16_t>(1u << k);
+                    child_near[i] = std::min(child_near[i], t_near[i]);
+                }
+            }
+        }
+
+        // Push far to near, finishing thin subtrees ray by ray right away
+        entry hits[4];
+        int hit_count = 0;
+        for (int i = 0; i < 4; i++) {
+            if (child_mask[i] == 0)
+                continue;
+            entry h = { node.child[i], node.count[i], child_mask[i], child_near[i] };
+
+            int alive = 0;
+            for (int k = 0; k < packet.size; k++)
+                alive += (child_mask[i] >> k) & 1;
+            if (alive < min_packet_rays) {
+                for (int k = 0; k < packet.size; k++) {
+                    if (!(child_mask[i] & (1u << k)))
+                        continue;
+                    traverse(rays[k], h, t_min, t_max[k],
+                        [&](uint32_t index, real t0, real& t1) { return hit_primitive(k, index, t0, t1); });
+                }
+                continue;
+            }
+
+            int k = hit_count++;
+            while (k > 0 && hits[k - 1].t_near < h.t_near) {
+                hits[k] = hits[k - 1];
+                k--;
+            }
+            hits[k] = h;
+        }
+        for (int i = 0; i < hit_count; i++)
+            stack[stack_size++] = hits[i];
+    }
+}
+
+// Class for a drop-in accelerator over a hittable list backed by the 4-wide bvh
+class wide_bvh : public hittable {
+    public:
+        std::vector<hittable*> objects;
+        std::vector<hittable*> unbounded;
+        bvh4 tree;
+        double binary_sah_cost;
+
+    public:
+        wide_bvh(const hittable_list& list, double time0, double time1) {
+            std::vector<aabb> boxes;
+            boxes.reserve(list.objects.size());
+            objects.reserve(list.objects.size());
+            for (const auto& object : list.objects) {
+                aabb box;
+                if (object->bounding_box(time0, time1, box)) {
+                    objects.push_back(object);
+                    boxes.push_back(box);
+                }
+                else
+                    unbounded.push_back(object);
+            }
+
+            flat_bvh binary(boxes);
+            binary_sah_cost = binary.sah_cost();
+            root = binary.empty() ? aabb() : binary.root_box();
+            tree = bvh4(binary);
+        }
+
+        virtual bool hit(
+            const ray& r, real t_min, real t_max, hit_record& rec) const override;
+
+        virtual bool occluded(const ray& r, real t_min, real t_max) const override;
+
+        virtual bool find_occluder(const ray& r, real t_min, real t_max, occluder_hint& hint) const override;
+
+        virtual bool bounding_box(double time0, double time1, aabb& output_box) const override;
+
+        // The scene the accelerator was built over, in the order of its list
+        virtual uint64_t scene_key(uint64_t key) const override {
+            for (const auto& list : { &objects, &unbounded }) {
+                key = scene_key_add(key, static_cast<double>(list->size()));
+                for (const auto& object : *list)
+                    key = object->scene_key(key);
+            }
+            return key;
+        }
+
+        // Closest hit of every ray of a packet, hit[k] tells if rec[k] is valid
+        void hit_packet(const ray_packet& packet, real t_min, real t_max, hit_record rec[], bool hit[]) const;
+
+        // SAH cost of the binary tree the wide one was collapsed from
+        double sah_cost() const { return binary_sah_cost; }
+
+    private:
+        aabb root;
+};
+
+bool wide_bvh::hit(const ray& r, real t_min, real t_max, hit_record& rec) const {
+    bool hit_anything = false;
+    for (const auto& object : unbounded) {
+        if (dispatch_hit(*object, r, t_min, t_max, rec)) {
+            hit_anything = true;
+            t_max = rec.t;
+        }
+    }
+
+    bool hit_tree = tree.intersect(r, t_min, t_max, [&](uint32_t index, real t0, real& t1) {
+        if (!dispatch_hit(*objects[index], r, t0, t1, rec))
+            return false;
+        t1 = rec.t;
+        return true;
+    });
+
+    return hit_anything || hit_tree;
+}
+
+bool wide_bvh::occluded(const ray& r, real t_min, real t_max) const {
+    for (const auto& object : unbounded) {
+        if (dispatch_occluded(*object, r, t_min, t_max))
+            return true;
+    }
+    return tree.occluded(r, t_min, t_max, [&](uint32_t index) {
+        return dispatch_occluded(*objects[index], r, t_min, t_max);
+    });
+}
+
+bool wide_bvh::find_occluder(const ray& r, real t_min, real t_max, occluder_hint& hint) const {
+    for (const auto& object : unbounded) {
+        if (dispatch_find_occluder(*object, r, t_min, t_max, hint))
+            return true;
+    }
+    return tree.occluded(r, t_min, t_max, [&](uint32_t index) {
+        return dispatch_find_occluder(*objects[index], r, t_min, t_max, hint);
+    });
+}
+
+void wide_bvh::hit_packet(const ray_packet& packet, real t_min, real t_max, hit_record rec[], bool hit[]) const {
+    real closest[ray_packet::max_size];
+    for (int k = 0; k < packet.size; k++) {
+        hit[k] = false;
+        closest[k] = t_max;
+        for (const auto& object : unbounded) {
+            if (dispatch_hit(*object, packet.rays[k], t_min, closest[k], rec[k])) {
+                hit[k] = true;
+                closest[k] = rec[k].t;
+            }
+        }
+    }
+
+    tree.intersect_packet(packet, t_min, closest, [&](int k, uint32_t index, real t0, real& t1) {
+        if (!dispatch_hit(*objects[index], packet.rays[k], t0, t1, rec[k]))
+            return false;
+        t1 = rec[k].t;
+        hit[k] = true;
+        return true;
+    });
+}
+
+bool wide_bvh::bounding_box(double time0, double time1, aabb& output_box) const {
+    if (!unbounded.empty() || tree.empty())
+        return false;
+    output_box = root;
+    return true;
+}
+
+#endif
@@ -0,0 +1,321 @@
+#ifndef BVH_BUILD_H
+#define BVH_BUILD_H
+
+#include "aabb.h"
+#include "thread_pool.h"
+#include "utility.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+// Helpers for building bvh trees with the binned surface area heuristic (SAH).
+// Builders cache every primitive's box (with its centroid) once in a vector and then only move
+// 32-bit primitive indices around, partitioning them in place.
+// Reference: Physically Based Rendering, 4.3.2 The Surface Area Heuristic;
+//            Wald, On fast Construction of SAH-based Bounding Volume Hierarchies
+
+// Costs of one traversal step and one primitive intersection, relative to each other
+const double sah_traversal_cost = 0.125;
+const double sah_intersection_cost = 1.0;
+const int sah_bin_count = 16;
+
+// Ranges larger than this are built as separate tasks
+const uint32_t parallel_subtree_threshold = 4096;
+// Nodes larger than this are bounded, binned and partitioned in parallel chunks
+const uint32_t parallel_node_threshold = 1u << 16;
+const uint32_t parallel_chunk_size = 1u << 14;
+
+// Result of the split search. axis is -1 if the centroids cannot be separated.
+struct sah_split {
+    int axis = -1;
+    int bin = 0;
+    double cost = infinity;
+};
+
+// Bounds grown in place, cheaper than chaining surrounding_box in the inner loops
+struct bin_bounds {
+    real lo[3];
+    real hi[3];
+
+    bin_bounds() : lo{ real(infinity), real(infinity), real(infinity) }, hi{ -real(infinity), -real(infinity), -real(infinity) } {}
+
+    void grow(const point3& min, const point3& max) {
+        for (int a = 0; a < 3; a++) {
+            lo[a] = std::min(lo[a], min[a]);
+            hi[a] = std::max(hi[a], max[a]);
+        }
+    }
+
+    void grow(const bin_bounds& b) {
+        for (int a = 0; a < 3; a++) {
+            lo[a] = std::min(lo[a], b.lo[a]);
+            hi[a] = std::max(hi[a], b.hi[a]);
+        }
+    }
+
+    double surface_area() const {
+        double dx = hi[0] - lo[0], dy = hi[1] - lo[1], dz = hi[2] - lo[2];
+        return 2 * (dx * dy + dx * dz + dy * dz);
+    }
+};
+
+// Bounds of the boxes and of their centroids over an index range
+inline void range_bounds(const std::vector<aabb>& boxes, const uint32_t* first, const uint32_t* last,
+    bin_bounds& box, bin_bounds& centroid_box)
+{
+    for (const uint32_t* p = first; p != last; p++) {
+        const aabb& b = boxes[*p];
+        box.grow(b.minimum, b.maximum);
+        centroid_box.grow(b.centroid, b.centroid);
+    }
+}
+
+inline void range_bounds(const std::vector<aabb>& boxes, const uint32_t* first, const uint32_t* last,
+    aabb& box, aabb& centroid_box)
+{
+    bin_bounds b, c;
+    range_bounds(boxes, first, last, b, c);
+    box = aabb(point3(b.lo[0], b.lo[1], b.lo[2]), point3(b.hi[0], b.hi[1], b.hi[2]));
+    centroid_box = aabb(point3(c.lo[0], c.lo[1], c.lo[2]), point3(c.hi[0], c.hi[1], c.hi[2]));
+}
+
+// Primitive counts and bounds of the bins along all three axes
+struct sah_bins {
+    int count[3][sah_bin_count];
+    bin_bounds box[3][sah_bin_count];
+
+    sah_bins() {
+        for (int a = 0; a < 3; a++)
+            for (int b = 0; b < sah_bin_count; b++)
+                count[a][b] = 0;
+    }
+
+    void merge(const sah_bins& other) {
+        for (int a = 0; a < 3; a++)
+            for (int b = 0; b < sah_bin_count; b++) {
+                count[a][b] += other.count[a][b];
+                box[a][b].grow(other.box[a][b]);
+            }
+    }
+};
+
+// Scale from centroid offset to bin index along an axis
+inline double sah_bin_scale(const aabb& centroid_box, int axis) {
+    return sah_bin_count / (centroid_box.maximum[axis] - centroid_box.minimum[axis]);
+}
+
+// Bin a centroid falls in along an axis
+inline int sah_bin_index(const aabb& centroid_box, int axis, double scale, double c) {
+    int b = static_cast<int>((c - centroid_box.minimum[axis]) * scale);
+    return std::min(std::max(b, 0), sah_bin_count - 1);
+}
+
+// Drop the boxes of an index range into the bins of all three axes in a single pass over the boxes
+inline void bin_primitives(const std::vector<aabb>& boxes, const uint32_t* first, const uint32_t* last,
+    const aabb& centroid_box, sah_bins& bins)
+{
+    double scale[3];
+    for (int a = 0; a < 3; a++)
+        scale[a] = centroid_box.maximum[a] > centroid_box.minimum[a] ? sah_bin_scale(centroid_box, a) : 0;
+
+    for (const uint32_t* p = first; p != last; p++) {
+        const aabb& b = boxes[*p];
+        for (int a = 0; a < 3; a++) {
+            int bin = sah_bin_index(centroid_box, a, scale[a], b.centroid[a]);
+            bins.count[a][bin]++;
+            bins.box[a][bin].grow(b.minimum, b.maximum);
+        }
+    }
+}
+
+// Sweep the bin boundaries of every axis and return the cheapest split of a node with bounds box
+inline sah_split evaluate_sah_bins(const sah_bins& bins, const aabb& box, const aabb& centroid_box) {
+    sah_split best;
+    // Flat nodes have no area, any positive scale keeps the order of the candidate costs
+    double area = box.surface_area();
+    double inv_area = area > 0 ? 1.0 / area : 1.0;
+
+    for (int a = 0; a < 3; a++) {
+        if (centroid_box.maximum[a] <= centroid_box.minimum[a])
+            continue;
+
+        // Sweep from the right to get the area and count right of each boundary
+        double right_area[sah_bin_count];
+        int right_count[sah_bin_count];
+        bin_bounds acc;
+        int n = 0;
+        for (int b = sah_bin_count - 1; b > 0; b--) {
+            n += bins.count[a][b];
+            if (bins.count[a][b] > 0)
+                acc.grow(bins.box[a][b]);
+            right_count[b] = n;
+            right_area[b] = n > 0 ? acc.surface_area() : 0;
+        }
+
+        // Sweep from the left and evaluate the split after bin b
+        acc = bin_bounds();
+        n = 0;
+        for (int b = 0; b < sah_bin_count - 1; b++) {
+            n += bins.count[a][b];
+            if (bins.count[a][b] > 0)
+                acc.grow(bins.box[a][b]);
+            if (n == 0 || right_count[b + 1] == 0)
+                continue;
+            double cost = sah_traversal_cost + sah_intersection_cost * inv_area *
+                (n * acc.surface_area() + right_count[b + 1] * right_area[b + 1]);
+            if (cost < best.cost) {
+                best.axis = a;
+                best.bin = b;
+                best.cost = cost;
+            }
+        }
+    }
+
+    return best;
+}
+
+// Find the cheapest binned split of an index range
+inline sah_split find_sah_split(const std::vector<aabb>& boxes, const uint32_t* first, const uint32_t* last,
+    const aabb& box, const aabb& centroid_box)
+{
+    sah_bins bins;
+    bin_primitives(boxes, first, last, centroid_box, bins);
+    return evaluate_sah_bins(bins, box, centroid_box);
+}
+
+// Move the indices left of the split to the front, returns the first index of the right side
+inline uint32_t* partition_sah(const std::vector<aabb>& boxes, uint32_t* first, uint32_t* last,
+    const aabb& centroid_box, const sah_split& split)
+{
+    double scale = sah_bin_scale(centroid_box, split.axis);
+    return std::partition(first, last, [&](uint32_t p) {
+        return sah_bin_index(centroid_box, split.axis, scale, boxes[p].centroid[split.axis]) <= split.bin;
+    });
+}
+
+inline uint32_t chunk_count(uint32_t n) {
+    return (n + parallel_chunk_size - 1) / parallel_chunk_size;
+}
+
+// Run f(chunk, begin, end) over fixed-size chunks of [0, n) on the pool. Chunk boundaries depend on n
+// only, so the results do not depend on the number of threads.
+template <typename F>
+void parallel_chunks(thread_pool& pool, uint32_t n, F f) {
+    uint32_t chunks = chunk_count(n);
+    task_group group(pool);
+    for (uint32_t c = 1; c < chunks; c++)
+        group.run([&f, c, n]() { f(c, c * parallel_chunk_size, std::min(n, (c + 1) * parallel_chunk_size)); });
+    f(0, 0, std::min(n, parallel_chunk_size));
+    group.wait();
+}
+
+// range_bounds over chunks of a large range
+inline void parallel_range_bounds(thread_pool& pool, const std::vector<aabb>& boxes,
+    const uint32_t* first, const uint32_t* last, aabb& box, aabb& centroid_box)
+{
+    uint32_t n = static_cast<uint32_t>(last - first);
+    std::vector<bin_bounds> chunk_box(chunk_count(n)), chunk_centroid(chunk_count(n));
+    parallel_chunks(pool, n, [&](uint32_t c, uint32_t begin, uint32_t end) {
+        range_bounds(boxes, first + begin, first + end, chunk_box[c], chunk_centroid[c]);
+    });
+
+    bin_bounds b, cb;
+    for (size_t c = 0; c < chunk_box.size(); c++) {
+        b.grow(chunk_box[c]);
+        cb.grow(chunk_centroid[c]);
+    }
+    box = aabb(point3(b.lo[0], b.lo[1], b.lo[2]), point3(b.hi[0], b.hi[1], b.hi[2]));
+    centroid_box = aabb(point3(cb.lo[0], cb.lo[1], cb.lo[2]), point3(cb.hi[0], cb.hi[1], cb.hi[2]));
+}
+
+// find_sah_split binning each chunk into its own bins and merging them
+inline sah_split parallel_find_sah_split(thread_pool& pool, const std::vector<aabb>& boxes,
+    const uint32_t* first, const uint32_t* last, const aabb& box, const aabb& centroid_box)
+{
+    uint32_t n = static_cast<uint32_t>(last - first);
+    std::vector<sah_bins> chunk_bins(chunk_count(n));
+    parallel_chunks(pool, n, [&](uint32_t c, uint32_t begin, uint32_t end) {
+        bin_primitives(boxes, first + begin, first + end, centroid_box, chunk_bins[c]);
+    });
+
+    for (size_t c = 1; c < chunk_bins.size(); c++)
+        chunk_bins[0].merge(chunk_bins[c]);
+    return evaluate_sah_bins(chunk_bins[0], box, centroid_box);
+}
+
+// Stable-by-chunk partition of a large range: every chunk partitions itself, then the left and right
+// parts are gathered behind each other through a scratch buffer. Returns the first index of the right side.
+template <typename Pred>
+uint32_t* parallel_partition(thread_pool& pool, uint32_t* first, uint32_t* last, Pred pred) {
+    uint32_t n = static_cast<uint32_t>(last - first);
+    uint32_t chunks = chunk_count(n);
+    std::vector<uint32_t> left_count(chunks);
+    parallel_chunks(pool, n, [&](uint32_t c, uint32_t begin, uint32_t end) {
+        left_count[c] = static_cast<uint32_t>(std::partition(first + begin, first + end, pred) - (first + begin));
+    });
+
+    std::vector<uint32_t> left_offset(chunks), right_offset(chunks);
+    uint32_t total_left = 0;
+    for (uint32_t c = 0; c < chunks; c++) {
+        left_offset[c] = total_left;
+        total_left += left_count[c];
+    }
+    uint32_t right = total_left;
+    for (uint32_t c = 0; c < chunks; c++) {
+        right_offset[c] = right;
+        right += std::min(n, (c + 1) * parallel_chunk_size) - c * parallel_chunk_size - left_count[c];
+    }
+
+    std::vector<uint32_t> scratch(n);
+    parallel_chunks(pool, n, [&](uint32_t c, uint32_t begin, uint32_t end) {
+        uint32_t split = begin + left_count[c];
+        std::copy(first + begin, first + split, scratch.begin() + left_offset[c]);
+        std::copy(first + split, first + end, scratch.begin() + right_offset[c]);
+    });
+    parallel_chunks(pool, n, [&](uint32_t c, uint32_t begin, uint32_t end) {
+        std::copy(scratch.begin() + begin, scratch.begin() + end, first + begin);
+    });
+
+    return first + total_left;
+}
+
+// Pick the serial or chunked version of each build step by the size of the range
+inline void build_range_bounds(thread_pool& pool, const std::vector<aabb>& boxes,
+    const uint32_t* first, const uint32_t* last, aabb& box, aabb& centroid_box)
+{
+    if (static_cast<uint32_t>(last - first) > parallel_node_threshold)
+        parallel_range_bounds(pool, boxes, first, last, box, centroid_box);
+    else
+        range_bounds(boxes, first, last, box, centroid_box);
+}
+
+inline sah_split build_find_sah_split(thread_pool& pool, const std::vector<aabb>& boxes,
+    const uint32_t* first, const uint32_t* last, const aabb& box, const aabb& centroid_box)
+{
+    if (static_cast<uint32_t>(last - first) > parallel_node_threshold)
+        return parallel_find_sah_split(pool, boxes, first, last, box, centroid_box);
+    return find_sah_split(boxes, first, last, box, centroid_box);
+}
+
+inline uint32_t* build_partition_sah(thread_pool& pool, const std::vector<aabb>& boxes,
+    uint32_t* first, uint32_t* last, const aabb& centroid_box, const sah_split& split)
+{
+    if (static_cast<uint32_t>(last - first) <= parallel_node_threshold)
+        return partition_sah(boxes, first, last, centroid_box, split);
+
+    double scale = sah_bin_scale(centroid_box, split.axis);
+    return parallel_partition(pool, first, last, [&](uint32_t p) {
+        return sah_bin_index(centroid_box, split.axis, scale, boxes[p].centroid[split.axis]) <= split.bin;
+    });
+}
+
+// Fallback when the centroids cannot be binned apart: split the range in two equal halves
+inline uint32_t* partition_equal_counts(const std::vector<aabb>& boxes, uint32_t* first, uint32_t* last, int axis) {
+    uint32_t* mid = first + (last - first) / 2;
+    std::nth_element(first, mid, last,
+        [&](uint32_t a, uint32_t b) { return boxes[a].centroid[axis] < boxes[b].centroid[axis]; });
+    return mid;
+}
+
+#endif
@@ -0,0 +1,131 @@
+#ifndef DISPATCH_H
+#define DISPATCH_H
+
+#include "aarect.h"
+#include "hittable.h"
+#include "material.h"
+#include "plane.h"
+#include "sphere.h"
+#include "triangle.h"
+#include "triangle_mesh.h"
+#include "utility.h"
+
+// Dispatch over the closed sets of built-in hittables and materials. The type tag selects a direct call
+// into the final class, which the compiler can inline into the traversal and shading loops; types it
+// does not know (tag none) still go through the virtual functions, so the scene stays extensible.
+// Only primitives are dispatched here, so the aggregates (hittable_list, the bvhs) can include this
+// header for the calls into their objects; bvh_node calls its own inner nodes directly.
+
+// Closest hit of one object, declared in hittable.h
+inline bool dispatch_hit(const hittable& object, const ray& r, real t_min, real t_max, hit_record& rec) {
+    switch (object.kind()) {
+        case primitive_kind::sphere: return static_cast<const sphere&>(object).sphere::hit(r, t_min, t_max, rec);
+        case primitive_kind::plane: return static_cast<const plane&>(object).plane::hit(r, t_min, t_max, rec);
+        case primitive_kind::triangle: return static_cast<const triangle&>(object).triangle::hit(r, t_min, t_max, rec);
+        case primitive_kind::xy_rect: return static_cast<const xy_rect&>(object).xy_rect::hit(r, t_min, t_max, rec);
+        case primitive_kind::xz_rect: return static_cast<const xz_rect&>(object).xz_rect::hit(r, t_min, t_max, rec);
+        case primitive_kind::yz_rect: return static_cast<const yz_rect&>(object).yz_rect::hit(r, t_min, t_max, rec);
+        case primitive_kind::triangle_mesh: return static_cast<const triangle_mesh&>(object).triangle_mesh::hit(r, t_min, t_max, rec);
+        default: return object.hit(r, t_min, t_max, rec);
+    }
+}
+
+// Any hit of one object, declared in hittable.h
+inline bool dispatch_occluded(const hittable& object, const ray& r, real t_min, real t_max) {
+    switch (object.kind()) {
+        case primitive_kind::sphere: return static_cast<const sphere&>(object).sphere::occluded(r, t_min, t_max);
+        case primitive_kind::plane: return static_cast<const plane&>(object).plane::occluded(r, t_min, t_max);
+        case primitive_kind::triangle: return static_cast<const triangle&>(object).triangle::occluded(r, t_min, t_max);
+        case primitive_kind::xy_rect: return static_cast<const xy_rect&>(object).xy_rect::occluded(r, t_min, t_max);
+        case primitive_kind::xz_rect: return static_cast<const xz_rect&>(object).xz_rect::occluded(r, t_min, t_max);
+        case primitive_kind::yz_rect: return static_cast<const yz_rect&>(object).yz_rect::occluded(r, t_min, t_max);
+        case primitive_kind::triangle_mesh: return static_cast<const triangle_mesh&>(object).triangle_mesh::occluded(r, t_min, t_max);
+        default: return object.occluded(r, t_min, t_max);
+    }
+}
+
+// Any hit of one object and the primitive behind it, declared in hittable.h
+inline bool dispatch_find_occluder(const hittable& object, const ray& r, real t_min, real t_max, occluder_hint& hint) {
+    switch (object.kind()) {
+        case primitive_kind::triangle_mesh:
+            return static_cast<const triangle_mesh&>(object).triangle_mesh::find_occluder(r, t_min, t_max, hint);
+        case primitive_kind::none:
+        case primitive_kind::bvh_node:
+            return object.find_occluder(r, t_min, t_max, hint);
+        default:
+            if (!dispatch_occluded(object, r, t_min, t_max))
+                return false;
+            hint.object = &object;
+            hint.face = 0;
+            return true;
+    }
+}
+
+// Whether the primitive of a hint still blocks r
+inline bool hint_occludes(const occluder_hint& hint, const ray& r, real t_min, real t_max) {
+    if (!hint.object)
+        return false;
+    if (hint.object->kind() == primitive_kind::triangle_mesh)
+        return static_cast<const triangle_mesh*>(hint.object)->face_occluded(hint.face, r, t_min, t_max);
+    return dispatch_occluded(*hint.object, r, t_min, t_max);
+}
+
+// Direct calls into a built-in material, the qualified names skip the virtual dispatch
+template <typename M>
+struct material_calls {
+    static color emitted(const material& m, const hit_record& rec) {
+        return static_cast<const M&>(m).M::emitted(rec.u, rec.v, rec.p);
+    }
+    static bool scatter(const material& m, const ray& r, const hit_record& rec, color& attenuation, ray& scattered, const sample2& u) {
+        return static_cast<const M&>(m).M::scatter(r, rec, attenuation, scattered, u);
+    }
+    static double scatter_pdf(const material& m, const ray& r, const hit_record& rec, const ray& scattered) {
+        return static_cast<const M&>(m).M::scatter_pdf(r, rec, scattered);
+    }
+};
+
+// Materials of unknown type go through the virtual functions
+template <>
+struct material_calls<material> {
+    static color emitted(const material& m, const hit_record& rec) {
+        return m.emitted(rec.u, rec.v, rec.p);
+    }
+    static bool scatter(const material& m, const ray& r, const hit_record& rec, color& attenuation, ray& scattered, const sample2& u) {
+        return m.scatter(r, rec, attenuation, scattered, u);
+    }
+    static double scatter_pdf(const material& m, const ray& r, const hit_record& rec, const ray& scattered) {
+        return m.scatter_pdf(r, rec, scattered);
+    }
+};
+
+// Call f with the material_calls of the type of m
+template <typename F>
+auto visit_material(const material& m, F&& f) -> decltype(f(material_calls<material>())) {
+    switch (m.kind()) {
+        case material_kind::default_mat: return f(material_calls<default_mat>());
+        case material_kind::lambertian: return f(material_calls<lambertian>());
+        case material_kind::metal: return f(material_calls<metal>());
+        case material_kind::dielectric: return f(material_calls<dielectric>());
+        case material_kind::diffuse_light: return f(material_calls<diffuse_light>());
+        default: return f(material_calls<material>());
+    }
+}
+
+// Emission, scattering and scattering density of the material at a hit
+inline color dispatch_emitted(const hit_record& rec) {
+    return visit_material(*rec.mat_ptr, [&](auto calls) { return decltype(calls)::emitted(*rec.mat_ptr, rec); });
+}
+
+inline bool dispatch_scatter(const ray& r, const hit_record& rec, color& attenuation, ray& scattered, const sample2& u) {
+    return visit_material(*rec.mat_ptr, [&](auto calls) {
+        return decltype(calls)::scatter(*rec.mat_ptr, r, rec, attenuation, scattered, u);
+    });
+}
+
+inline double dispatch_scatter_pdf(const ray& r, const hit_record& rec, const ray& scattered) {
+    return visit_material(*rec.mat_ptr, [&](auto calls) {
+        return decltype(calls)::scatter_pdf(*rec.mat_ptr, r, rec, scattered);
+    });
+}
+
+#endif
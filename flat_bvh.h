@@ -0,0 +1,345 @@
+#ifndef FLAT_BVH_H
+#define FLAT_BVH_H
+
+#include "aabb.h"
+#include "bvh_build.h"
+#include "mapped_file.h"
+#include "utility.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+// Node of the flattened bvh, 32 bytes so two nodes share a cache line.
+// Nodes are stored in depth-first order: the first child of an interior node directly follows it,
+// the second child is at second_child. Leaves reference count primitives starting at first_primitive.
+struct linear_bvh_node {
+    float box_min[3];
+    float box_max[3];
+    union {
+        uint32_t first_primitive;
+        uint32_t second_child;
+    };
+    uint16_t count;
+    uint8_t axis;
+    uint8_t pad;
+
+    bool is_leaf() const { return count > 0; }
+};
+
+static_assert(sizeof(linear_bvh_node) == 32, "linear_bvh_node must stay 32 bytes");
+
+// Deepest leaf of a flat_bvh, which bounds the traversal stacks. Below split_depth_limit the builder
+// stops following its split heuristic, whose splits can be arbitrarily lopsided, and halves the ranges
+// by count; halving ends any range of 32-bit size within another 32 levels.
+const int flat_bvh_max_depth = 64;
+const int split_depth_limit = flat_bvh_max_depth - 32;
+
+// Class for a pointer-free bvh over primitives given only by their bounding boxes.
+// It knows nothing about the primitives themselves: traversal hands primitive indices to a callback,
+// which lets the same layout accelerate hittable lists and triangle meshes alike.
+// Reference: Physically Based Rendering, 4.3.4 Compact BVH For Traversal
+class flat_bvh {
+    public:
+        mapped_array<linear_bvh_node> nodes;
+        mapped_array<uint32_t> primitive_indices;
+
+    private:
+        struct build_node {
+            aabb box;
+            std::unique_ptr<build_node> children[2];
+            int axis = 0;
+            uint32_t first = 0;
+            uint32_t count = 0;
+        };
+
+        int max_leaf_size;
+
+    public:
+        flat_bvh() : max_leaf_size(4) {}
+
+        flat_bvh(const std::vector<aabb>& primitive_boxes, int leaf_size = 4, thread_pool& pool = thread_pool::global())
+            : max_leaf_size(leaf_size)
+        {
+            build(primitive_boxes, pool);
+        }
+
+        // Tree built earlier, e.g. views into a scene cache
+        flat_bvh(mapped_array<linear_bvh_node> built_nodes, mapped_array<uint32_t> built_indices, int leaf_size = 4)
+            : nodes(std::move(built_nodes)), primitive_indices(std::move(built_indices)), max_leaf_size(leaf_size) {}
+
+        bool empty() const { return nodes.empty(); }
+
+        aabb root_box() const {
+            const linear_bvh_node& root = nodes[0];
+            return aabb(point3(root.box_min[0], root.box_min[1], root.box_min[2]),
+                point3(root.box_max[0], root.box_max[1], root.box_max[2]));
+        }
+
+        // Expected cost of a random ray under the surface area heuristic, in units of primitive tests
+        double sah_cost() const;
+
+        // Find the closest hit. hit_primitive(index, t_min, t_max) tests one primitive and returns true
+        // on a hit, in which case t_max shrinks to the hit distance and later boxes are culled by it.
+        template <typename F>
+        bool intersect(const ray& r, real t_min, real t_max, F&& hit_primitive) const;
+
+        // Find any hit. occludes(index) tests one primitive over [t_min, t_max], the traversal returns
+        // on the first one that reports a hit and visits children in no particular order.
+        template <typename F>
+        bool occluded(const ray& r, real t_min, real t_max, F&& occludes) const;
+
+    private:
+        void build(const std::vector<aabb>& primitive_boxes, thread_pool& pool);
+
+        std::unique_ptr<build_node> build_recursive(thread_pool& pool,
+            const std::vector<aabb>& boxes, uint32_t start, uint32_t end, int depth, std::atomic<uint32_t>& total_nodes);
+
+        void build_children(thread_pool& pool, const std::vector<aabb>& boxes, build_node* node,
+            uint32_t start, uint32_t mid, uint32_t end, int depth, std::atomic<uint32_t>& total_nodes);
+
+        uint32_t flatten(const build_node* node);
+
+        static float round_down(double x) {
+            float f = static_cast<float>(x);
+            return f > x ? std::nextafter(f, -std::numeric_limits<float>::infinity()) : f;
+        }
+
+        static float round_up(double x) {
+            float f = static_cast<float>(x);
+            return f < x ? std::nextafter(f, std::numeric_limits<float>::infinity()) : f;
+        }
+};
+
+// Iterative traversal with a fixed stack, visiting the child on the near side of the split first
+template <typename F>
+bool flat_bvh::intersect(const ray& r, real t_min, real t_max, F&& hit_primitive) const {
+    if (nodes.empty())
+        return false;
+
+    const int* dir_is_neg = r.dir_is_neg();
+    const linear_bvh_node* node_data = nodes.data();
+    const uint32_t* index_data = primitive_indices.data();
+
+    bool hit_anything = false;
+    uint32_t stack[flat_bvh_max_depth];
+    int stack_size = 0;
+    uint32_t current = 0;
+
+    while (true) {
+        const linear_bvh_node& node = node_data[current];
+        if (slab_test(node.box_min, node.box_max, r, t_min, t_max)) {
+            if (node.is_leaf()) {
+                for (uint32_t i = 0; i < node.count; i++) {
+                    if (hit_primitive(index_data[node.first_primitive + i], t_min, t_max))
+                        hit_anything = true;
+                }
+                if (stack_size == 0) break;
+                current = stack[--stack_size];
+            }
+            else if (dir_is_neg[node.axis]) {
+                stack[stack_size++] = current + 1;
+                current = node.second_child;
+            }
+            else {
+                stack[stack_size++] = node.second_child;
+                current = current + 1;
+            }
+        }
+        else {
+            if (stack_size == 0) break;
+            current = stack[--stack_size];
+        }
+    }
+
+    return hit_anything;
+}
+
+template <typename F>
+bool flat_bvh::occluded(const ray& r, real t_min, real t_max, F&& occludes) const {
+    if (nodes.empty())
+        return false;
+
+    const linear_bvh_node* node_data = nodes.data();
+    const uint32_t* index_data = primitive_indices.data();
+
+    uint32_t stack[flat_bvh_max_depth];
+    int stack_size = 0;
+    uint32_t current = 0;
+
+    while (true) {
+        const linear_bvh_node& node = node_data[current];
+        if (slab_test(node.box_min, node.box_max, r, t_min, t_max)) {
+            if (node.is_leaf()) {
+                for (uint32_t i = 0; i < node.count; i++) {
+                    if (occludes(index_data[node.first_primitive + i]))
+                        return true;
+                }
+                if (stack_size == 0) break;
+                current = stack[--stack_size];
+            }
+            else {
+                stack[stack_size++] = node.second_child;
+                current = current + 1;
+            }
+        }
+        else {
+            if (stack_size == 0) break;
+            current = stack[--stack_size];
+        }
+    }
+
+    return false;
+}
+
+void flat_bvh::build(const std::vector<aabb>& primitive_boxes, thread_pool& pool) {
+    nodes.edit().clear();
+    std::vector<uint32_t>& indices = primitive_indices.edit();
+    indices.resize(primitive_boxes.size());
+    for (uint32_t i = 0; i < indices.size(); i++)
+        indices[i] = i;
+    if (primitive_boxes.empty())
+        return;
+
+    std::atomic<uint32_t> total_nodes(0);
+    std::unique_ptr<build_node> root = build_recursive(pool, primitive_boxes, 0, static_cast<uint32_t>(primitive_boxes.size()), 0, total_nodes);
+
+    nodes.edit().reserve(total_nodes);
+    flatten(root.get());
+}
+
+// Split with the binned surface area heuristic, partitioning the index array in place.
+// Large subtrees are built as tasks on the pool, large nodes are binned and partitioned in chunks.
+// Ranges still too large at split_depth_limit are split into equal halves, see flat_bvh_max_depth.
+std::unique_ptr<flat_bvh::build_node> flat_bvh::build_recursive(thread_pool& pool,
+    const std::vector<aabb>& boxes, uint32_t start, uint32_t end, int depth, std::atomic<uint32_t>& total_nodes)
+{
+    std::unique_ptr<build_node> node(new build_node());
+    total_nodes++;
+
+    uint32_t* base = primitive_indices.edit().data();
+    uint32_t* first = base + start;
+    uint32_t* last = base + end;
+    aabb centroid_box;
+    build_range_bounds(pool, boxes, first, last, node->box, centroid_box);
+
+    uint32_t count = end - start;
+    if (count == 1 || (depth >= split_depth_limit && count <= static_cast<uint32_t>(max_leaf_size))) {
+        node->first = start;
+        node->count = count;
+        return node;
+    }
+
+    uint32_t* mid;
+    if (depth >= split_depth_limit) {
+        int axis = 0;
+        vec3 extent = centroid_box.max() - centroid_box.min();
+        if (extent[1] > extent[axis]) axis = 1;
+        if (extent[2] > extent[axis]) axis = 2;
+        node->axis = axis;
+        mid = partition_equal_counts(boxes, first, last, axis);
+        build_children(pool, boxes, node.get(), start, static_cast<uint32_t>(mid - base), end, depth, total_nodes);
+        return node;
+    }
+
+    // Keep a leaf if no split beats testing every primitive, unless it would overflow the node
+    sah_split split = build_find_sah_split(pool, boxes, first, last, node->box, centroid_box);
+    double leaf_cost = sah_intersection_cost * count;
+    bool must_split = count > static_cast<uint32_t>(max_leaf_size);
+    if (!must_split && split.cost >= leaf_cost) {
+        node->first = start;
+        node->count = count;
+        return node;
+    }
+
+    if (split.axis >= 0) {
+        node->axis = split.axis;
+        mid = build_partition_sah(pool, boxes, first, last, centroid_box, split);
+    }
+    else {
+        // All centroids coincide, no plane separates them
+        if (count <= 0xffff) {
+            node->first = start;
+            node->count = count;
+            return node;
+        }
+        node->axis = 0;
+        mid = partition_equal_counts(boxes, first, last, 0);
+    }
+
+    build_children(pool, boxes, node.get(), start, static_cast<uint32_t>(mid - base), end, depth, total_nodes);
+    return node;
+}
+
+void flat_bvh::build_children(thread_pool& pool, const std::vector<aabb>& boxes, build_node* node,
+    uint32_t start, uint32_t mid, uint32_t end, int depth, std::atomic<uint32_t>& total_nodes)
+{
+    if (end - start > parallel_subtree_threshold) {
+        task_group group(pool);
+        group.run([&]() { node->children[0] = build_recursive(pool, boxes, start, mid, depth + 1, total_nodes); });
+        node->children[1] = build_recursive(pool, boxes, mid, end, depth + 1, total_nodes);
+        group.wait();
+    }
+    else {
+        node->children[0] = build_recursive(pool, boxes, start, mid, depth + 1, total_nodes);
+        node->children[1] = build_recursive(pool, boxes, mid, end, depth + 1, total_nodes);
+    }
+}
+
+// Lay out the build tree depth-first into the node array, returns the offset of the node
+uint32_t flat_bvh::flatten(const build_node* node) {
+    std::vector<linear_bvh_node>& out_nodes = nodes.edit();
+    uint32_t offset = static_cast<uint32_t>(out_nodes.size());
+    out_nodes.emplace_back();
+
+    linear_bvh_node& out = out_nodes[offset];
+    for (int a = 0; a < 3; a++) {
+        out.box_min[a] = round_down(node->box.min()[a]);
+        out.box_max[a] = round_up(node->box.max()[a]);
+    }
+    out.axis = static_cast<uint8_t>(node->axis);
+    out.pad = 0;
+
+    if (node->count > 0) {
+        out.first_primitive = node->first;
+        out.count = static_cast<uint16_t>(node->count);
+    }
+    else {
+        out.count = 0;
+        flatten(node->children[0].get());
+        uint32_t second = flatten(node->children[1].get());
+        out_nodes[offset].second_child = second;
+    }
+    return offset;
+}
+
+// Sum the area-weighted cost of all interior and leaf nodes relative to the root box
+double flat_bvh::sah_cost() const {
+    if (nodes.empty())
+        return 0;
+
+    auto area = [](const linear_bvh_node& n) {
+        double dx = n.box_max[0] - n.box_min[0];
+        double dy = n.box_max[1] - n.box_min[1];
+        double dz = n.box_max[2] - n.box_min[2];
+        return 2 * (dx * dy + dx * dz + dy * dz);
+    };
+
+    // A flat root (all primitives in a line or a point) has no area to relate to, every ray that
+    // reaches it is taken to visit every node
+    double root_area = area(nodes[0]);
+    auto weight = [&](const linear_bvh_node& n) { return root_area > 0 ? area(n) / root_area : 1.0; };
+
+    double cost = 0;
+    for (const linear_bvh_node& n : nodes) {
+        if (n.is_leaf())
+            cost += sah_intersection_cost * n.count * weight(n);
+        else
+            cost += sah_traversal_cost * weight(n);
+    }
+    return cost;
+}
+
+#endif
@@ -3,35 +3,118 @@
 
 #include "aabb.h"
 #include "ray.h"
+#include "sampler.h"
 #include "utility.h"
 
+#include <cstdint>
+#include <cstring>
+
+class hittable;
 class material;
 
+// Fold value into a scene key. Scene keys tell apart the scenes and settings that render differently,
+// so a checkpoint of a progressive render is only resumed for the same image.
+inline uint64_t scene_key_add(uint64_t key, double value) {
+    uint64_t bits;
+    std::memcpy(&bits, &value, sizeof(bits));
+    return rng::mix(key ^ bits);
+}
+
+inline uint64_t scene_key_add(uint64_t key, const vec3& v) {
+    for (int a = 0; a < 3; a++)
+        key = scene_key_add(key, static_cast<double>(v[a]));
+    return key;
+}
+
 // Structure for holding hit data when the ray hit an object
 // Reference: Ray Tracing in One Weekend
 struct hit_record {
     point3 p;
     vec3 normal;
-    double t;
-    double u;
-    double v;
-    shared_ptr<material> mat_ptr;
+    real t;
+    real u;
+    real v;
+    const material* mat_ptr = nullptr;
     bool front_face;
     color objectColor;
 
-    // Check if hit front face or back face with direction of ray and normal
+    // Check if hit front face or back face with direction of ray and normal. outward_normal must be unit
+    // length, the materials and the light sampling densities rely on it.
     inline void set_face_normal(const ray& r, const vec3& outward_normal) {
         front_face = dot(r.direction(), outward_normal) < 0;
         normal = front_face ? outward_normal : -outward_normal;
     }
 };
 
+// Primitive that blocked a shadow ray, tested first by the next query of a coherent stream of them.
+// face is the face of a triangle mesh and unused for other objects.
+struct occluder_hint {
+    const hittable* object = nullptr;
+    uint32_t face = 0;
+};
+
+// Type tag of the built-in hittables. The built-in classes are final and pass their tag to the base, so
+// dispatch_hit (dispatch.h) can call them directly and let the compiler inline the intersection.
+// Everything else, accelerators and new primitives, is none and goes through the virtual hit.
+enum class primitive_kind : uint32_t { none, sphere, plane, triangle, xy_rect, xz_rect, yz_rect, triangle_mesh, bvh_node, count };
+
 // Base class for all the hittable objects
 // Reference: Ray Tracing in One Weekend
 class hittable {
 public:
-    virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const = 0;
+    hittable(primitive_kind k = primitive_kind::none) : tag(k) {}
+
+    primitive_kind kind() const { return tag; }
+
+    virtual bool hit(const ray& r, real t_min, real t_max, hit_record& rec) const = 0;
     virtual bool bounding_box(double time0, double time1, aabb& output_box) const = 0;
+
+    // Whether anything blocks r between t_min and t_max, for shadow rays. Implementations stop at the
+    // first hit they find and compute no surface data; this fallback runs the full closest hit.
+    virtual bool occluded(const ray& r, real t_min, real t_max) const {
+        hit_record rec;
+        return hit(r, t_min, t_max, rec);
+    }
+
+    // occluded, and on a hit the primitive that blocks the ray in hint. Aggregates report the object
+    // inside them rather than themselves.
+    virtual bool find_occluder(const ray& r, real t_min, real t_max, occluder_hint& hint) const {
+        if (!occluded(r, t_min, t_max))
+            return false;
+        hint.object = this;
+        hint.face = 0;
+        return true;
+    }
+
+    // Objects that can be sampled as lights: random(o, u) returns a direction from o towards the object,
+    // chosen with the sample u, and pdf_value(o, v) the solid angle density of random returning v.
+    // Zero for everything else.
+    // Reference: Ray Tracing: The Rest of Your Life
+    virtual double pdf_value(const point3&, const vec3&) const { return 0.0; }
+    virtual vec3 random(const point3&, const sample2&) const { return vec3(1, 0, 0); }
+
+    // Material of the whole object, nullptr for aggregates and objects without one
+    virtual const material* get_material() const { return nullptr; }
+
+    // Fold everything about the object that shows in the image into key: its shape, material and
+    // color. This fallback only knows the type and the bounds, objects override it with their own
+    // parameters and aggregates with their contents.
+    virtual uint64_t scene_key(uint64_t key) const {
+        key = scene_key_add(key, static_cast<double>(kind()));
+        aabb box;
+        if (bounding_box(0, 1, box))
+            key = scene_key_add(scene_key_add(key, box.min()), box.max());
+        return key;
+    }
+
+private:
+    primitive_kind tag;
 };
 
+// Closest hit and occlusion of one object, without a virtual call for the built-in types; defined in
+// dispatch.h, which every caller includes
+inline bool dispatch_hit(const hittable& object, const ray& r, real t_min, real t_max, hit_record& rec);
+inline bool dispatch_occluded(const hittable& object, const ray& r, real t_min, real t_max);
+inline bool dispatch_find_occluder(const hittable& object, const ray& r, real t_min, real t_max, occluder_hint& hint);
+
 #endif
\ No newline at end of file
@@ -2,48 +2,59 @@
 #define HITTABLE_LIST
 
 #include "aabb.h"
+#include "dispatch.h"
 #include "hittable.h"
 
-#include <memory>
+#include <algorithm>
 #include <vector>
 
-using std::shared_ptr;
-using std::make_shared;
-
-// Class that holds the vector of hittable objects
+// Class that holds the vector of hittable objects. The objects are owned by the scene_arena they were
+// made in, the list only refers to them.
 // Reference: Ray Tracing in One Weekend
 class hittable_list : public hittable {
 	public:
-		std::vector<shared_ptr<hittable>> objects;
+		std::vector<hittable*> objects;
 
 	public:
 		hittable_list() {}
-		hittable_list(shared_ptr<hittable> object) { add(object); }
+		hittable_list(hittable* object) { add(object); }
 
 		void clear() { objects.clear(); }
-		void add(shared_ptr<hittable> object) { objects.push_back(object); }
+		void add(hittable* object) { objects.push_back(object); }
 
 		virtual bool hit(
-			const ray& r, double t_min, double t_max, hit_record& rec) const override;
+			const ray& r, real t_min, real t_max, hit_record& rec) const override;
+
+		virtual bool occluded(const ray& r, real t_min, real t_max) const override;
+
+		virtual bool find_occluder(const ray& r, real t_min, real t_max, occluder_hint& hint) const override;
 
 		virtual bool bounding_box(
 			double time0, double time1, aabb& output_box) const override;
 
-		bool shadow_hit(const ray& r);
+		// Lights are sampled by picking one object uniformly
+		virtual double pdf_value(const point3& o, const vec3& v) const override;
+		virtual vec3 random(const point3& o, const sample2& u) const override;
+
+		virtual uint64_t scene_key(uint64_t key) const override {
+			key = scene_key_add(key, static_cast<double>(objects.size()));
+			for (const auto& object : objects)
+				key = object->scene_key(key);
+			return key;
+		}
 };
 
-// Check all the hittable objects in the vector to find the closet hit
-bool hittable_list::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
-	hit_record temp_rec;
+// Check all the hittable objects in the vector to find the closet hit.
+// Objects only write rec when they report a hit closer than closest_so_far, so it is updated in place.
+bool hittable_list::hit(const ray& r, real t_min, real t_max, hit_record& rec) const {
 	bool hit_anything = false;
 	auto closest_so_far = t_max;
 
-	for (const auto& object : objects) {
+	for (const hittable* object : objects) {
 		// Find the closest t and update
-		if (object->hit(r, t_min, closest_so_far, temp_rec)) {
+		if (dispatch_hit(*object, r, t_min, closest_so_far, rec)) {
 			hit_anything = true;
-			closest_so_far = temp_rec.t;
-			rec = temp_rec;
+			closest_so_far = rec.t;
 		}
 	}
 
@@ -67,15 +78,37 @@ bool hittable_list::bounding_box(double time0, double time1, aabb& output_box) c
 	return true;
 }
 
-// Check if shadow ray hit any object
-bool hittable_list::shadow_hit(const ray& r) {
-	hit_record temp_rec;
+// Average density of the objects, each is picked with the same probability
+double hittable_list::pdf_value(const point3& o, const vec3& v) const {
+	if (objects.empty()) return 0.0;
 
-	for (const auto& object : objects) {
-		// Use epsilon to remove possible glitches of hitting itself
-		if (object->hit(r, epsilon, 1.0, temp_rec)) {
+	double sum = 0.0;
+	for (const auto& object : objects)
+		sum += object->pdf_value(o, v);
+	return sum / objects.size();
+}
+
+vec3 hittable_list::random(const point3& o, const sample2& u) const {
+	// The first coordinate picks the object and, rescaled to [0,1), stays a sample for it
+	double scaled = u.u * objects.size();
+	size_t i = std::min(static_cast<size_t>(scaled), objects.size() - 1);
+	return objects[i]->random(o, sample2{ scaled - i, u.v });
+}
+
+// Check if any object blocks the ray, the first one found ends the search
+bool hittable_list::occluded(const ray& r, real t_min, real t_max) const {
+	for (const hittable* object : objects) {
+		if (dispatch_occluded(*object, r, t_min, t_max))
+			return true;
+	}
+
+	return false;
+}
+
+bool hittable_list::find_occluder(const ray& r, real t_min, real t_max, occluder_hint& hint) const {
+	for (const hittable* object : objects) {
+		if (dispatch_find_occluder(*object, r, t_min, t_max, hint))
 			return true;
-		}
 	}
 
 	return false;
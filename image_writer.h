@@ -0,0 +1,154 @@
+#ifndef IMAGE_WRITER_H
+#define IMAGE_WRITER_H
+
+#include "thread_pool.h"
+#include "tile_renderer.h"
+#include "utility.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+enum class image_format {
+    ppm_ascii,     // P3, one formatted pixel per line
+    ppm_binary,    // P6, three bytes per pixel
+    pfm            // Portable float map, linear HDR values without tone mapping
+};
+
+// Mapping of linear radiance to output bytes: scale by exposure, optionally compress with Reinhard's
+// operator x / (1 + x), then encode with 1 / gamma. Exposure 1, gamma 1 and no tone mapping is the
+// plain clamp of the original P3 writer.
+struct tone_settings {
+    double exposure;
+    double gamma;
+    bool reinhard;
+};
+
+const tone_settings linear_tone = { 1.0, 1.0, false };
+
+// Class for the byte encoding of a tone mapping. The table is indexed by the output byte: it holds the
+// linear value where the gamma curve reaches every byte, and a pixel is encoded by a binary search in
+// it instead of three calls to pow. Every byte is reached exactly where pow would reach it, also in the
+// shadows where a curve tabulated over linear steps skips the first bytes.
+class tone_mapper {
+    private:
+        tone_settings settings;
+        bool identity;
+        std::vector<double> thresholds;     // Linear value of bytes 1 to 255
+
+    public:
+        tone_mapper(const tone_settings& s) : settings(s), identity(s.gamma == 1.0), thresholds(255) {
+            for (int b = 1; b <= 255; b++)
+                thresholds[b - 1] = std::pow(b / 256.0, settings.gamma);
+        }
+
+        uint8_t encode(double x) const {
+            x *= settings.exposure;
+            if (settings.reinhard)
+                x = x > 0 ? x / (1 + x) : 0;
+            if (identity)
+                return static_cast<uint8_t>(256 * clamp(x, 0.0, 0.999));
+            if (!(x > 0))
+                return 0;
+            return static_cast<uint8_t>(std::upper_bound(thresholds.begin(), thresholds.end(), x) - thresholds.begin());
+        }
+};
+
+// Quantize the average of every pixel (the sums over samples) into rgb bytes, rows in parallel
+inline std::vector<uint8_t> quantize_image(thread_pool& pool, const framebuffer& fb, int samples, const tone_settings& tone) {
+    tone_mapper mapper(tone);
+    double scale = 1.0 / samples;
+    std::vector<uint8_t> bytes(fb.pixels.size() * 3);
+    parallel_for(pool, static_cast<size_t>(fb.height), 16, [&](size_t begin, size_t end) {
+        for (size_t y = begin; y < end; y++) {
+            uint8_t* out = &bytes[y * fb.width * 3];
+            for (int x = 0; x < fb.width; x++) {
+                const color& c = fb.at(x, static_cast<int>(y));
+                *out++ = mapper.encode(c.x() * scale);
+                *out++ = mapper.encode(c.y() * scale);
+                *out++ = mapper.encode(c.z() * scale);
+            }
+        }
+    });
+    return bytes;
+}
+
+// Append the decimal digits of a byte
+inline char* format_byte(char* out, uint8_t v) {
+    if (v >= 100) *out++ = static_cast<char>('0' + v / 100);
+    if (v >= 10) *out++ = static_cast<char>('0' + v / 10 % 10);
+    *out++ = static_cast<char>('0' + v % 10);
+    return out;
+}
+
+// Write fb, holding the sums of samples samples per pixel, to path. The whole file is assembled in
+// memory and written with one call. Nothing is written without samples to average.
+inline bool write_image(const std::string& path, const framebuffer& fb, int samples, image_format format,
+    const tone_settings& tone = linear_tone, thread_pool& pool = thread_pool::global())
+{
+    if (samples < 1) {
+        std::cerr << "No samples to write to " << path << "\n";
+        return false;
+    }
+
+    std::string header;
+    std::vector<char> body;
+
+    if (format == image_format::pfm) {
+        // Rows bottom to top, a negative scale marks little-endian floats
+        header = "PF\n" + std::to_string(fb.width) + ' ' + std::to_string(fb.height) + "\n-1.0\n";
+        body.resize(fb.pixels.size() * 3 * sizeof(float));
+        double scale = 1.0 / samples;
+        parallel_for(pool, static_cast<size_t>(fb.height), 16, [&](size_t begin, size_t end) {
+            for (size_t row = begin; row < end; row++) {
+                float* out = reinterpret_cast<float*>(&body[row * fb.width * 3 * sizeof(float)]);
+                int y = fb.height - 1 - static_cast<int>(row);
+                for (int x = 0; x < fb.width; x++) {
+                    const color& c = fb.at(x, y);
+                    *out++ = static_cast<float>(c.x() * scale);
+                    *out++ = static_cast<float>(c.y() * scale);
+                    *out++ = static_cast<float>(c.z() * scale);
+                }
+            }
+        });
+    }
+    else {
+        std::vector<uint8_t> bytes = quantize_image(pool, fb, samples, tone);
+        std::string size = std::to_string(fb.width) + ' ' + std::to_string(fb.height) + "\n255\n";
+        if (format == image_format::ppm_binary) {
+            header = "P6\n" + size;
+            body.assign(bytes.begin(), bytes.end());
+        }
+        else {
+            // At most 12 characters per pixel
+            header = "P3\n" + size;
+            body.resize(fb.pixels.size() * 12);
+            char* out = body.data();
+            for (size_t k = 0; k < bytes.size(); k += 3) {
+                out = format_byte(out, bytes[k]);
+                *out++ = ' ';
+                out = format_byte(out, bytes[k + 1]);
+                *out++ = ' ';
+                out = format_byte(out, bytes[k + 2]);
+                *out++ = '\n';
+            }
+            body.resize(static_cast<size_t>(out - body.data()));
+        }
+    }
+
+    std::ofstream file(path, std::ios::binary | std::ios::trunc);
+    file.write(header.data(), static_cast<std::streamsize>(header.size()));
+    file.write(body.data(), static_cast<std::streamsize>(body.size()));
+    if (!file) {
+        std::cerr << "Cannot write " << path << "\n";
+        return false;
+    }
+    return true;
+}
+
+#endif
@@ -1,51 +1,76 @@
 #ifndef LIGHT_H
 #define LIGHT_H
 
-#include "hittable.h"
-#include "material.h"
+#include "utility.h"
 #include "vec3.h"
 
-// Class for light source. It intialize parallel point light and compute phong shading
+#include <cmath>
+#include <limits>
+
+enum class light_type { point, directional, spot };
+
+// Class for light source of the Phong preview (whitted.h). A point light shines from a position in all
+// directions, a directional light is parallel light from infinitely far away, and a spot light is a
+// point light limited to a cone that fades out between an inner and an outer angle.
 class light {
-	private:
-		point3 lightPos;
-		color lightColor;
-		const double ambientStrength = 0.2;
-		const double specularStrength = 0.5;
+	public:
+		light_type type;
+		point3 position;      // Point and spot lights
+		vec3 direction;       // Unit direction the light travels, directional and spot lights
+		color intensity;
+		double cos_inner;     // Spot lights: full intensity inside the inner cone, none outside the outer
+		double cos_outer;
 
 	public:
-		light() : lightPos(point3(0, 0, 0)), lightColor(color(1.0, 1.0, 1.0)) {}
-		light(point3 pos, color col) {
-			lightPos = pos;
-			lightColor = col;
+		light() : light(point3(0, 0, 0), color(1.0, 1.0, 1.0)) {}
+
+		// Point light
+		light(point3 pos, color col)
+			: type(light_type::point), position(pos), direction(0, -1, 0), intensity(col), cos_inner(-1), cos_outer(-1) {}
+
+		static light directional(const vec3& dir, const color& col) {
+			light l;
+			l.type = light_type::directional;
+			l.direction = unit_vector(dir);
+			l.intensity = col;
+			return l;
 		}
 
-		// Get color on 1 pixel with phong shading model
-		color phong_shading(const hit_record& rec, hittable_list world, const ray& r) {
-			color objectColor = rec.mat_ptr->getColor();
-			vec3 unit_normal = unit_vector(rec.normal);
-			if (!rec.front_face) {
-				unit_normal *= -1;
-			}
-			vec3 unit_lightDir = unit_vector(lightPos - rec.p);
-			ray shadow_ray = ray(rec.p, lightPos - rec.p);
-			
-			// Ambient
-			color ambientColor = (ambientStrength * lightColor) * objectColor;
-
-			// Diffuse
-			double nl_dot = std::max(dot(unit_normal, unit_lightDir), 0.0);
-			color diffuseColor = nl_dot * lightColor * objectColor;
-
-			// Specular
-			vec3 unit_view = unit_vector(r.origin() - rec.p);
-			vec3 unit_reflectDir = 2 * dot(unit_lightDir, unit_normal) * unit_normal - unit_lightDir;
-			double rv_dot = std::max(dot(unit_reflectDir, unit_view), 0.0);
-			color specularColor = pow(rv_dot, 32) * specularStrength * objectColor;
-
-			// If object is in shadow, only return ambient light, otherwise return the sum of all lights
-			return ambientColor + ((world.shadow_hit(shadow_ray)) ? (vec3(0, 0, 0) + diffuseColor + specularColor) / 3.0 : diffuseColor + specularColor);
+		static light spot(const point3& pos, const vec3& dir, const color& col, double inner_degrees, double outer_degrees) {
+			light l(pos, col);
+			l.type = light_type::spot;
+			l.direction = unit_vector(dir);
+			l.cos_inner = cos(degrees_to_radians(inner_degrees));
+			l.cos_outer = cos(degrees_to_radians(outer_degrees));
+			return l;
 		}
+
+		// Light arriving at p. to_light is the unit direction towards the light and distance how far it
+		// is along it, infinity for directional lights; a shadow ray covers [0, distance).
+		color illuminate(const point3& p, vec3& to_light, real& distance) const;
 };
 
-#endif
\ No newline at end of file
+inline color light::illuminate(const point3& p, vec3& to_light, real& distance) const {
+	if (type == light_type::directional) {
+		to_light = -direction;
+		distance = std::numeric_limits<real>::infinity();
+		return intensity;
+	}
+
+	vec3 offset = position - p;
+	distance = offset.length();
+	to_light = offset / distance;
+	if (type == light_type::point)
+		return intensity;
+
+	// Smoothstep between the cone angles
+	double cosine = -dot(to_light, direction);
+	if (cosine <= cos_outer)
+		return color(0, 0, 0);
+	if (cosine >= cos_inner)
+		return intensity;
+	double x = (cosine - cos_outer) / (cos_inner - cos_outer);
+	return (x * x * (3 - 2 * x)) * intensity;
+}
+
+#endif
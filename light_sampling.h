@@ -0,0 +1,102 @@
+#ifndef LIGHT_SAMPLING_H
+#define LIGHT_SAMPLING_H
+
+#include "dispatch.h"
+#include "hittable.h"
+#include "hittable_list.h"
+#include "material.h"
+#include "utility.h"
+
+#include <algorithm>
+#include <iostream>
+
+// Next event estimation: at every non-specular hit a direction towards a randomly picked light is traced
+// as well, besides the direction chosen by the material. Light reaching the path along either direction
+// is weighted with the power heuristic of the two densities, so each strategy counts where it is the
+// better one and the sum stays unbiased.
+// The light samples only see the objects in the list of lights, found in that short list and checked
+// against the rest of the scene with an occlusion query. So the emission of a surface hit by the
+// material's direction is weighted only if it is a light (a diffuse_light material, which is expected
+// to be in the list); the glow of other surfaces is left to the material's direction alone.
+// Reference: Physically Based Rendering, 13.10.1 Multiple Importance Sampling
+
+// Fraction of the distance to a light that a shadow ray checks, stops short of the light's own surface
+const real shadow_ray_extent = 1 - 1e-4;
+
+// Power heuristic with exponent two, weight of a sample drawn with pdf against the other strategy
+inline double power_heuristic(double pdf, double other_pdf) {
+    double a = pdf * pdf;
+    double b = other_pdf * other_pdf;
+    return a / (a + b);
+}
+
+// Light sample u at a hit whose material scattered with attenuation and has a density (not specular).
+// Returns false if there is nothing to sample. Otherwise shadow is the ray towards the light and weight
+// the factor of the emission found at its closest hit: BSDF times cosine over the light density, with
+// the MIS weight applied.
+inline bool sample_lights(const hittable_list& lights, const ray& r_in, const hit_record& rec,
+    const color& attenuation, const sample2& u, ray& shadow, color& weight)
+{
+    if (lights.objects.empty())
+        return false;
+
+    shadow = ray(rec.p, lights.random(rec.p, u));
+    double light_pdf = lights.pdf_value(rec.p, shadow.direction());
+    double bsdf_pdf = dispatch_scatter_pdf(r_in, rec, shadow);
+    if (light_pdf <= 0 || bsdf_pdf <= 0)
+        return false;
+
+    weight = attenuation * (bsdf_pdf * power_heuristic(light_pdf, bsdf_pdf) / light_pdf);
+    return true;
+}
+
+// Whether lights holds exactly the emitters of world, the objects with a diffuse_light material, as
+// emission_weight expects: an emitter missing from lights would be weighted against light samples
+// that never pick it, and a light of another material would be counted in full by both strategies.
+// Objects inside aggregates of world are not looked into. A mismatch is reported on std::cerr.
+inline bool lights_match_emitters(const hittable_list& world, const hittable_list& lights) {
+    auto emits = [](const hittable* object) {
+        const material* m = object->get_material();
+        return m && m->kind() == material_kind::diffuse_light;
+    };
+    auto listed = [&](const hittable* object) {
+        return std::find(lights.objects.begin(), lights.objects.end(), object) != lights.objects.end();
+    };
+
+    size_t unlisted = 0, not_emitting = 0;
+    for (const hittable* object : world.objects) {
+        if (emits(object) && !listed(object))
+            unlisted++;
+    }
+    for (const hittable* object : lights.objects) {
+        if (!emits(object))
+            not_emitting++;
+    }
+    if (unlisted > 0)
+        std::cerr << unlisted << " diffuse_light objects are not in the list of lights\n";
+    if (not_emitting > 0)
+        std::cerr << not_emitting << " lights do not have a diffuse_light material\n";
+    return unlisted == 0 && not_emitting == 0;
+}
+
+// Emission of the closest light along a light sample, unless something in world blocks it
+inline color trace_light_sample(const hittable& world, const hittable_list& lights, const ray& shadow) {
+    hit_record rec;
+    if (!lights.hit(shadow, 0.001, infinity, rec))
+        return color(0, 0, 0);
+    if (world.occluded(shadow, 0.001, rec.t * shadow_ray_extent))
+        return color(0, 0, 0);
+    return dispatch_emitted(rec);
+}
+
+// MIS weight of emission at rec found by following r, which the material chose with density bsdf_pdf.
+// A zero density (camera rays, specular bounces) or a surface that is not a light means no light
+// sample competed for it.
+inline double emission_weight(const hittable_list& lights, const ray& r, const hit_record& rec, double bsdf_pdf) {
+    if (bsdf_pdf <= 0 || lights.objects.empty() || rec.mat_ptr->kind() != material_kind::diffuse_light)
+        return 1;
+    double light_pdf = lights.pdf_value(r.origin(), r.direction());
+    return light_pdf > 0 ? power_heuristic(bsdf_pdf, light_pdf) : 1;
+}
+
+#endif
@@ -0,0 +1,105 @@
+#ifndef LINEAR_BVH_H
+#define LINEAR_BVH_H
+
+#include "dispatch.h"
+#include "flat_bvh.h"
+#include "hittable.h"
+#include "hittable_list.h"
+#include "utility.h"
+
+#include <vector>
+
+// Class for a drop-in accelerator over a hittable list, backed by the flattened bvh.
+// Objects without a bounding box (planes) cannot go into the tree and are tested on their own.
+class linear_bvh : public hittable {
+    public:
+        std::vector<hittable*> objects;
+        std::vector<hittable*> unbounded;
+        flat_bvh tree;
+
+    public:
+        linear_bvh(const hittable_list& list, double time0, double time1) {
+            std::vector<aabb> boxes;
+            boxes.reserve(list.objects.size());
+            objects.reserve(list.objects.size());
+            for (const auto& object : list.objects) {
+                aabb box;
+                if (object->bounding_box(time0, time1, box)) {
+                    objects.push_back(object);
+                    boxes.push_back(box);
+                }
+                else
+                    unbounded.push_back(object);
+            }
+            tree = flat_bvh(boxes);
+        }
+
+        virtual bool hit(
+            const ray& r, real t_min, real t_max, hit_record& rec) const override;
+
+        virtual bool occluded(const ray& r, real t_min, real t_max) const override;
+
+        virtual bool find_occluder(const ray& r, real t_min, real t_max, occluder_hint& hint) const override;
+
+        virtual bool bounding_box(double time0, double time1, aabb& output_box) const override;
+
+        // The scene the accelerator was built over, in the order of its list
+        virtual uint64_t scene_key(uint64_t key) const override {
+            for (const auto& list : { &objects, &unbounded }) {
+                key = scene_key_add(key, static_cast<double>(list->size()));
+                for (const auto& object : *list)
+                    key = object->scene_key(key);
+            }
+            return key;
+        }
+
+        double sah_cost() const { return tree.sah_cost(); }
+};
+
+bool linear_bvh::hit(const ray& r, real t_min, real t_max, hit_record& rec) const {
+    bool hit_anything = false;
+    for (const auto& object : unbounded) {
+        if (dispatch_hit(*object, r, t_min, t_max, rec)) {
+            hit_anything = true;
+            t_max = rec.t;
+        }
+    }
+
+    bool hit_tree = tree.intersect(r, t_min, t_max, [&](uint32_t index, real t0, real& t1) {
+        if (!dispatch_hit(*objects[index], r, t0, t1, rec))
+            return false;
+        t1 = rec.t;
+        return true;
+    });
+
+    return hit_anything || hit_tree;
+}
+
+bool linear_bvh::occluded(const ray& r, real t_min, real t_max) const {
+    for (const auto& object : unbounded) {
+        if (dispatch_occluded(*object, r, t_min, t_max))
+            return true;
+    }
+    return tree.occluded(r, t_min, t_max, [&](uint32_t index) {
+        return dispatch_occluded(*objects[index], r, t_min, t_max);
+    });
+}
+
+bool linear_bvh::find_occluder(const ray& r, real t_min, real t_max, occluder_hint& hint) const {
+    for (const auto& object : unbounded) {
+        if (dispatch_find_occluder(*object, r, t_min, t_max, hint))
+            return true;
+    }
+    return tree.occluded(r, t_min, t_max, [&](uint32_t index) {
+        return dispatch_find_occluder(*objects[index], r, t_min, t_max, hint);
+    });
+}
+
+bool linear_bvh::bounding_box(double time0, double time1, aabb& output_box) const {
+    if (!unbounded.empty() || tree.empty())
+        return false;
+    output_box = tree.root_box();
+    return true;
+}
+
+#endif
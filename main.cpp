@@ -1,40 +1,40 @@
 #include "utility.h"
 
 #include "aarect.h"
+#include "adaptive_sampler.h"
 #include "bvh.h"
+#include "bvh4.h"
 #include "camera.h"
+#include "dispatch.h"
 #include "hittable.h"
 #include "hittable_list.h"
-#include "jitter.h"
+#include "image_writer.h"
 #include "light.h"
+#include "light_sampling.h"
+#include "linear_bvh.h"
 #include "material.h"
 #include "obj.h"
 #include "plane.h"
+#include "progressive.h"
+#include "ray_packet.h"
+#include "sampler.h"
+#include "scene_arena.h"
 #include "sphere.h"
+#include "thread_pool.h"
+#include "tile_renderer.h"
 #include "triangle.h"
+#include "wavefront.h"
+#include "whitted.h"
 
 #include <chrono>
 #include <fstream>
 #include <iostream>
+#include <vector>
 
-void write_color(std::ofstream& out, color pixel_color, int samples_per_pixel) {
-    auto r = pixel_color.x();
-    auto g = pixel_color.y();
-    auto b = pixel_color.z();
-
-    // Divide the color by the number of samples.
-    auto scale = 1.0 / samples_per_pixel;
-    r *= scale;
-    g *= scale;
-    b *= scale;
-
-    // Write the translated [0,255] value of each color component.
-    out << static_cast<int>(256 * clamp(r, 0.0, 0.999)) << ' '
-        << static_cast<int>(256 * clamp(g, 0.0, 0.999)) << ' '
-        << static_cast<int>(256 * clamp(b, 0.0, 0.999)) << '\n';
-}
+color trace_path(const ray& r, const hit_record& first_hit, const color& background, const hittable& world,
+    const hittable_list& lights, int max_depth, sampler& s);
 
-color ray_color(const ray& r, const color& background, const hittable_list& world, int depth) {
+color ray_color(const ray& r, const color& background, const hittable& world, const hittable_list& lights, int depth, sampler& s) {
     hit_record rec;
 
     // If we've exceeded the ray bounce limit, no more light is gathered.
@@ -57,26 +57,132 @@ color ray_color(const ray& r, const color& background, const hittable_list& worl
     if (!world.hit(r, 0.001, infinity, rec))
         return background;
 
-    ray scattered;
-    color attenuation;
-    color emitted = rec.mat_ptr->emitted(rec.u, rec.v, rec.p);
+    return trace_path(r, rec, background, world, lights, depth, s);
+}
 
-    if (!rec.mat_ptr->scatter(r, rec, attenuation, scattered))
-        return emitted;
+// Follow a path whose first hit is already known, bounce by bounce in a loop.
+// The throughput is the product of the attenuations so far. After roulette_min_depth bounces the path
+// survives with a probability proportional to its throughput and the survivors are weighted up by
+// its inverse, which keeps the estimate unbiased while dim paths end early. Paths that lose all
+// throughput end right away, they cannot carry any more light.
+// At non-specular hits the lights are sampled directly as well (next event estimation), combined with
+// the scattered direction by multiple importance sampling.
+// Every bounce takes its BSDF, light and roulette samples from its own dimensions of the sampler.
+// Reference: Physically Based Rendering, 14.5.1 Russian Roulette
+color trace_path(const ray& r, const hit_record& first_hit, const color& background, const hittable& world,
+    const hittable_list& lights, int max_depth, sampler& s)
+{
+    color radiance(0, 0, 0);
+    color throughput(1, 1, 1);
+    ray current = r;
+    hit_record rec = first_hit;
+    double bsdf_pdf = 0;
+
+    for (int depth = 1; ; depth++) {
+        color emitted = dispatch_emitted(rec);
+        radiance += emission_weight(lights, current, rec, bsdf_pdf) * (throughput * emitted);
+
+        // If we've exceeded the ray bounce limit, no more light is gathered.
+        if (depth >= max_depth)
+            break;
+
+        ray scattered;
+        color attenuation;
+        if (!dispatch_scatter(current, rec, attenuation, scattered, s.bsdf_sample(depth)))
+            break;
+
+        bsdf_pdf = dispatch_scatter_pdf(current, rec, scattered);
+        ray shadow;
+        color weight;
+        if (bsdf_pdf > 0 && sample_lights(lights, current, rec, attenuation, s.light_sample(depth), shadow, weight))
+            radiance += (throughput * weight) * trace_light_sample(world, lights, shadow);
+
+        throughput = throughput * attenuation;
+
+        double max_throughput = std::max(throughput.x(), std::max(throughput.y(), throughput.z()));
+        if (max_throughput <= 0)
+            break;
+        if (depth >= roulette_min_depth) {
+            double survival = std::min(max_throughput, roulette_max_survival);
+            if (s.roulette_sample(depth) >= survival)
+                break;
+            throughput /= survival;
+        }
 
-    return emitted + attenuation * ray_color(scattered, background, world, depth - 1);
+        current = scattered;
+        if (!world.hit(current, 0.001, infinity, rec)) {
+            radiance += throughput * background;
+            break;
+        }
+    }
+
+    return radiance;
 }
 
-void area_light(hittable_list& world) {
+// Trace one camera sample for each of count pixel samples (at most a packet) and write their colors.
+// The camera rays are traced through the bvh as one packet, the rest of every path continues ray by ray.
+void trace_samples(const pixel_sample* samples, int count, color* colors, const framebuffer& fb, const camera& cam,
+    const wide_bvh& world, const hittable_list& lights, const color& background, int max_depth, const sampler& sampling)
+{
+    ray_packet packet;
+    sampler samplers[ray_packet::max_size];
+    for (int k = 0; k < count; k++) {
+        // Every sample starts its own copy of the sampler, so the image does not depend on the thread count
+        sampler& s = samplers[k];
+        s = sampling;
+        s.start(samples[k].i, samples[k].j, samples[k].sample);
+        sample2 offset = s.pixel_sample();
+        auto u = (samples[k].i + offset.u) / (fb.width - 1);
+        auto v = (samples[k].j + offset.v) / (fb.height - 1);
+        packet.add(cam.get_ray(u, v));
+    }
+
+    hit_record recs[ray_packet::max_size];
+    bool hits[ray_packet::max_size];
+    world.hit_packet(packet, 0.001, infinity, recs, hits);
+
+    for (int k = 0; k < count; k++) {
+        colors[k] = hits[k]
+            ? trace_path(packet.rays[k], recs[k], background, world, lights, max_depth, samplers[k])
+            : background;
+    }
+}
+
+// Add samples [first_sample, first_sample + sample_count) of a block of pixels to fb, one packet per
+// sample of all pixels in the block
+void render_block(const tile& block, framebuffer& fb, const camera& cam, const wide_bvh& world,
+    const hittable_list& lights, const color& background, int first_sample, int sample_count, int max_depth,
+    const sampler& sampling)
+{
+    pixel_sample samples[ray_packet::max_size];
+    color colors[ray_packet::max_size];
+    for (int s = first_sample; s < first_sample + sample_count; ++s) {
+        int count = 0;
+        for (int y = block.y0; y < block.y1; y++)
+            for (int i = block.x0; i < block.x1; i++)
+                samples[count++] = { i, fb.height - 1 - y, static_cast<uint32_t>(s) };
+
+        trace_samples(samples, count, colors, fb, cam, world, lights, background, max_depth, sampling);
+
+        int k = 0;
+        for (int y = block.y0; y < block.y1; y++)
+            for (int i = block.x0; i < block.x1; i++)
+                fb.at(i, y) += colors[k++];
+    }
+}
+
+void area_light(scene_arena& scene, hittable_list& world, hittable_list& lights) {
     // Create scene with area light
-    auto material_sphere = make_shared<lambertian>(color(0.3, 0.7, 0.2));
-    world.add(make_shared<sphere>(point3(-9, 0.0, -10), 2.5, material_sphere));
-    world.add(make_shared<sphere>(point3(-3, 0.0, -10), 2.5, material_sphere));
-    world.add(make_shared<sphere>(point3(3, 0.0, -10), 2.5, material_sphere));
-    world.add(make_shared<sphere>(point3(9, 0.0, -10), 2.5, material_sphere));
-
-    auto difflight = make_shared<diffuse_light>(color(15, 15, 15));
-    world.add(make_shared<xy_rect>(-5, 5, 0, 10, -25, difflight));
+    auto material_sphere = scene.make<lambertian>(color(0.3, 0.7, 0.2));
+    world.add(scene.make<sphere>(point3(-9, 0.0, -10), 2.5, material_sphere));
+    world.add(scene.make<sphere>(point3(-3, 0.0, -10), 2.5, material_sphere));
+    world.add(scene.make<sphere>(point3(3, 0.0, -10), 2.5, material_sphere));
+    world.add(scene.make<sphere>(point3(9, 0.0, -10), 2.5, material_sphere));
+
+    auto difflight = scene.make<diffuse_light>(color(15, 15, 15));
+    auto light_rect = scene.make<xy_rect>(-5, 5, 0, 10, -25, difflight);
+    world.add(light_rect);
+    lights.add(light_rect);
 }
 
 int main() {
@@ -85,10 +191,29 @@ int main() {
     const int image_height = 400;
     const int samples_per_pixel = 100;
     const int max_depth = 50;
+    static_assert(samples_per_pixel > 0, "the image is the average of at least one sample per pixel");
+    const bool wavefront_mode = false;
+    const bool adaptive_mode = false;
+    const bool progressive_mode = false;
+    const bool whitted_mode = false;
+
+    // Progressive passes are saved to the checkpoint every few minutes and resumed from it on the next
+    // run; raising samples_per_pixel extends a finished render. The stratified and cmj samplers size
+    // their patterns for samples_per_pixel, so with them a new count starts the render over.
+    const std::string checkpoint_path = "image_test_larger.accum";
+    const int pass_samples = 8;
+    const double checkpoint_seconds = 300;
+
+    // Adaptive sampling spends the same total budget, more of it on the noisy pixels
+    adaptive_settings adaptive;
+    adaptive.min_samples = 16;
+    adaptive.max_samples = 8 * samples_per_pixel;
+    adaptive.batch = 8;
+    adaptive.threshold = 0.02;
 
     // Colors
     color background = color(0, 0, 0);
-    vector<color> color_pool;
+    std::vector<color> color_pool;
     color_pool.push_back(color(1, 0, 0));
     color_pool.push_back(color(0, 1, 0));
     color_pool.push_back(color(0, 0, 1));
@@ -96,9 +221,11 @@ int main() {
     color_pool.push_back(color(1, 0, 1));
     color_pool.push_back(color(0, 1, 1));
 
+    // Scene storage, the objects and materials made below are owned here and freed together at exit
+    scene_arena scene;
+
     // Obj
-    //obj o1("cow.obj");
-    //o1.update_vertex_normals();
+    //obj o1(scene, "cow.obj", scene.make<lambertian>(color(0.7, 0.7, 0.7)));
 
     // Boxes
     hittable_list box1;
@@ -107,25 +234,35 @@ int main() {
     for (int i = 0; i < 1000; i++) {
         pos = point3(random_double(-2, 2), random_double(-2, 2), random_double(-2.1, -4));
         radii = 0.04;
-        //box1.add(make_shared<sphere>(pos, radii, color_pool[random_int(0, color_pool.size() - 1)]));
+        //box1.add(scene.make<sphere>(pos, radii, color_pool[random_int(0, color_pool.size() - 1)]));
     }
 
     // World
     hittable_list world;
-    auto material_plane = make_shared<lambertian>(color(0.7, 0.7, 0.7));
-    //auto material_sphere1 = make_shared<metal>(color(0.4, 1, 1));
-    //auto material_sphere2 = make_shared<metal>(color(0.6, 0.2, 0.1));
-    //auto material_sphere1 = make_shared<dielectric>(1.5);
-    //auto material_sphere2 = make_shared<dielectric>(1.5);
-
-    world.add(make_shared<plane>(point3(0.0, -2.5, -1.0), vec3(0.0, 1.0, 0.0), material_plane));
-    //world.add(make_shared<sphere>(point3(0.0, 0.2, -1.0), 0.5, material_sphere1));
-    //world.add(make_shared<sphere>(point3(0.0, 0.2, -1.0), -(0.5 * transparency_inner), material_sphere1));
-    //world.add(make_shared<sphere>(point3(0.8, -0.3, -1.4), 0.4, material_sphere2));
-    //world.add(make_shared<sphere>(point3(0.8, -0.3, -1.4), -(0.4 * transparency_inner), material_sphere2));
-
-    // Create a area light scene
-    area_light(world);
+    auto material_plane = scene.make<lambertian>(color(0.7, 0.7, 0.7));
+    //auto material_sphere1 = scene.make<metal>(color(0.4, 1, 1));
+    //auto material_sphere2 = scene.make<metal>(color(0.6, 0.2, 0.1));
+    //auto material_sphere1 = scene.make<dielectric>(1.5);
+    //auto material_sphere2 = scene.make<dielectric>(1.5);
+
+    world.add(scene.make<plane>(point3(0.0, -2.5, -1.0), vec3(0.0, 1.0, 0.0), material_plane));
+    //world.add(o1.getMesh());
+    //world.add(scene.make<sphere>(point3(0.0, 0.2, -1.0), 0.5, material_sphere1));
+    //world.add(scene.make<sphere>(point3(0.0, 0.2, -1.0), -(0.5 * transparency_inner), material_sphere1));
+    //world.add(scene.make<sphere>(point3(0.8, -0.3, -1.4), 0.4, material_sphere2));
+    //world.add(scene.make<sphere>(point3(0.8, -0.3, -1.4), -(0.4 * transparency_inner), material_sphere2));
+
+    // Create a area light scene, the emitters also go into the list of lights sampled directly
+    hittable_list lights;
+    area_light(scene, world, lights);
+    lights_match_emitters(world, lights);
+
+    // Acceleration structure over the world
+    std::chrono::steady_clock::time_point build_begin = std::chrono::steady_clock::now();
+    wide_bvh accel(world, 0, 1);
+    std::chrono::steady_clock::time_point build_end = std::chrono::steady_clock::now();
+    std::cout << "BVH Build Time = " << std::chrono::duration_cast<std::chrono::milliseconds>(build_end - build_begin).count() << "[ms]" << std::endl;
+    std::cout << "BVH SAH Cost = " << accel.sah_cost() << std::endl;
 
     // Camera
     camera cam(point3(0, 0, 0), point3(0, 0, -1), vec3(0, 1, 0));
@@ -133,35 +270,96 @@ int main() {
     // Alternative Camera
     camera alt_cam(point3(10, 5, 0), point3(5, 0, -10), vec3(0, 1, 0));
 
-    // Light
-    light spotLight = light(point3(0, 10, 5), color(0.9, 0.9, 0.9));
+    // Lights of the Phong preview, the path tracer only sees emitting objects
+    std::vector<light> preview_lights;
+    preview_lights.push_back(light(point3(0, 10, 5), color(0.9, 0.9, 0.9)));
+    preview_lights.push_back(light::directional(vec3(-1, -2, -1), color(0.3, 0.3, 0.35)));
+    preview_lights.push_back(light::spot(point3(0, 8, -10), vec3(0, -1, 0), color(0.8, 0.8, 0.6), 20, 30));
+
+    // Sample values of the path tracer, the patterns are sized for samples_per_pixel
+    sampler sampling(sampler_type::sobol, samples_per_pixel);
+
+    // Output File, binary P6 or float PFM keeping the HDR values; tone mapping applies to P3 and P6
+    const std::string output_path = "image_test_larger.ppm";
+    const image_format output_format = image_format::ppm_binary;
+    const tone_settings tone = linear_tone;
 
-    // Jitter
-    jitter jit = jitter(samples_per_pixel);
+    // Render perspective into the framebuffer, one tile per task
+    framebuffer fb(image_width, image_height);
+    tile_renderer renderer(image_width, image_height);
 
-    // Output File
-    std::ofstream output_file("image_test_larger.ppm");
+    adaptive_sampler adaptive_render(image_width, image_height, adaptive);
 
-    // Render perspective
-    output_file << "P3\n" << image_width << ' ' << image_height << "\n255\n";
+    // Checkpoints are only resumed for the same scene and settings: everything the path tracer reads goes
+    // into the key, the resolution is checked by the checkpoint itself
+    uint64_t scene_key = rng::mix(static_cast<uint64_t>(max_depth));
+    scene_key = world.scene_key(scene_key);
+    scene_key = lights.scene_key(scene_key);
+    scene_key = scene_key_add(scene_key, background);
+    scene_key = scene_key_add(scene_key, alt_cam);
+    scene_key = scene_key_add(scene_key, sampling);
+    accumulation_buffer acc(image_width, image_height, scene_key);
 
     std::chrono::steady_clock::time_point render_begin = std::chrono::steady_clock::now();
-    for (int j = image_height - 1; j >= 0; --j) {
-        std::cerr << "\rScanlines remaining: " << j << ' ' << std::flush;
-        for (int i = 0; i < image_width; ++i) {
-            color pixel_color(0, 0, 0);
-            for (int s = 0; s < samples_per_pixel; ++s) {
-                auto u = (i + random_double()) / (image_width - 1);
-                auto v = (j + random_double()) / (image_height - 1);
-                ray r = alt_cam.get_ray(u, v);
-                pixel_color += ray_color(r, background, world, max_depth);
+    if (adaptive_mode) {
+        adaptive_render.render(thread_pool::global(), renderer, fb, samples_per_pixel,
+            [&](const pixel_sample* samples, int count, color* colors) {
+                trace_samples(samples, count, colors, fb, alt_cam, accel, lights, background, max_depth, sampling);
+            });
+    }
+    else if (progressive_mode) {
+        acc.load(checkpoint_path);
+        render_progressive(acc, samples_per_pixel, pass_samples, checkpoint_path, checkpoint_seconds,
+            [&](uint32_t first, uint32_t count) {
+                renderer.for_each_tile(thread_pool::global(), [&](const tile& t) {
+                    for (int y = t.y0; y < t.y1; y += 4) {
+                        for (int x = t.x0; x < t.x1; x += 4) {
+                            tile block = { x, y, std::min(x + 4, t.x1), std::min(y + 4, t.y1) };
+                            render_block(block, acc.sums, alt_cam, accel, lights, background, first, count, max_depth, sampling);
+                        }
+                    }
+                });
+            });
+        fb.pixels = acc.sums.pixels;
+    }
+    else if (whitted_mode) {
+        // Fast preview, one Phong shaded ray per pixel with mirror and glass bounces
+        whitted_renderer preview(preview_lights, background);
+        preview.render(thread_pool::global(), renderer, fb, alt_cam, accel);
+    }
+    else if (wavefront_mode) {
+        // Staged kernels over waves of paths, same image as the tile renderer
+        wavefront_renderer wavefront(image_width, image_height, samples_per_pixel, max_depth, background, lights, sampling);
+        wavefront.render(thread_pool::global(), fb, alt_cam, accel);
+    }
+    else {
+        renderer.for_each_tile(thread_pool::global(), [&](const tile& t) {
+            // 4x4 pixel blocks, one packet of camera rays per sample
+            for (int y = t.y0; y < t.y1; y += 4) {
+                for (int x = t.x0; x < t.x1; x += 4) {
+                    tile block = { x, y, std::min(x + 4, t.x1), std::min(y + 4, t.y1) };
+                    render_block(block, fb, alt_cam, accel, lights, background, 0, samples_per_pixel, max_depth, sampling);
+                }
             }
-            write_color(output_file, pixel_color, samples_per_pixel);
-        }
+        });
     }
     std::chrono::steady_clock::time_point render_end = std::chrono::steady_clock::now();
     std::cout << "\nRender Time = " << std::chrono::duration_cast<std::chrono::milliseconds>(render_end - render_begin).count() << "[ms]" << std::endl;
 
+    // Write the finished image once, the adaptive sampler leaves the mean of every pixel and a resumed
+    // render may hold more samples than asked for
+    int fb_samples = adaptive_mode || whitted_mode ? 1 : progressive_mode ? static_cast<int>(acc.completed_samples()) : samples_per_pixel;
+    std::chrono::steady_clock::time_point write_begin = std::chrono::steady_clock::now();
+    write_image(output_path, fb, fb_samples, output_format, tone);
+    std::chrono::steady_clock::time_point write_end = std::chrono::steady_clock::now();
+    std::cout << "Write Time = " << std::chrono::duration_cast<std::chrono::milliseconds>(write_end - write_begin).count() << "[ms]" << std::endl;
+
+    // Samples taken per pixel, for tuning the thresholds
+    if (adaptive_mode) {
+        std::ofstream spp_file("spp_map.pgm");
+        adaptive_render.write_spp_map(spp_file);
+    }
+
     // Render alternative perspective
     //std::cout << "P3\n" << image_width << ' ' << image_height << "\n255\n";
 
@@ -175,25 +373,4 @@ int main() {
     //        write_color(std::cout, pixel_color, 1);
     //    }
     //}
-
-    // Render multi-jittered sampling
-    //output_file << "P3\n" << image_width << ' ' << image_height << "\n255\n";
-
-    //std::chrono::steady_clock::time_point render_begin = std::chrono::steady_clock::now();
-    //for (int j = image_height - 1; j >= 0; --j) {
-    //    std::cerr << "\rScanlines remaining: " << j << ' ' << std::flush;
-    //    for (int i = 0; i < image_width; ++i) {
-    //        color pixel_color(0, 0, 0);
-    //        vector<vector<double>> sample_points = jit.get_samples(i, j);
-    //        for (int s = 0; s < samples_per_pixel; ++s) {
-    //            auto u = sample_points[s][0] / (image_width - 1.0);
-    //            auto v = sample_points[s][1] / (image_height - 1.0);
-    //            ray r = alt_cam.get_ray(u, v);
-    //            pixel_color += ray_color(r, background, world, max_depth);
-    //        }
-    //        write_color(output_file, pixel_color, samples_per_pixel);
-    //    }
-    //}
-    //std::chrono::steady_clock::time_point render_end = std::chrono::steady_clock::now();
-    //std::cout << "\nRender Time = " << std::chrono::duration_cast<std::chrono::milliseconds>(render_end - render_begin).count() << "[ms]" << std::endl;
 }
\ No newline at end of file
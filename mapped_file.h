@@ -0,0 +1,193 @@
+#ifndef MAPPED_FILE_H
+#define MAPPED_FILE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+#include <sys/stat.h>
+#include <sys/types.h>
+
+// Class for a read-only memory mapping of a whole file.
+// The pages are loaded by the OS on first touch and shared between processes mapping the same file,
+// there is no copy into a user buffer. An empty or missing file gives an empty mapping.
+class mapped_file {
+    private:
+        const char* bytes = nullptr;
+        size_t length = 0;
+#ifdef _WIN32
+        HANDLE file = INVALID_HANDLE_VALUE;
+        HANDLE mapping = nullptr;
+#endif
+
+    public:
+        mapped_file() {}
+        mapped_file(const std::string& path) { open(path); }
+        ~mapped_file() { close(); }
+
+        mapped_file(const mapped_file&) = delete;
+        mapped_file& operator=(const mapped_file&) = delete;
+
+        bool open(const std::string& path);
+        void close();
+
+        bool is_open() const { return bytes != nullptr; }
+        const char* data() const { return bytes; }
+        size_t size() const { return length; }
+};
+
+#ifdef _WIN32
+
+inline bool mapped_file::open(const std::string& path) {
+    close();
+    file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+        FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+    if (file == INVALID_HANDLE_VALUE) {
+        std::cerr << "Cannot open " << path << "\n";
+        return false;
+    }
+
+    LARGE_INTEGER file_size;
+    if (!GetFileSizeEx(file, &file_size) || file_size.QuadPart == 0) {
+        close();
+        return false;
+    }
+
+    mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    if (mapping)
+        bytes = static_cast<const char*>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+    if (!bytes) {
+        std::cerr << "Cannot map " << path << "\n";
+        close();
+        return false;
+    }
+    length = static_cast<size_t>(file_size.QuadPart);
+    return true;
+}
+
+inline void mapped_file::close() {
+    if (bytes)
+        UnmapViewOfFile(bytes);
+    if (mapping)
+        CloseHandle(mapping);
+    if (file != INVALID_HANDLE_VALUE)
+        CloseHandle(file);
+    bytes = nullptr;
+    length = 0;
+    mapping = nullptr;
+    file = INVALID_HANDLE_VALUE;
+}
+
+#else
+
+inline bool mapped_file::open(const std::string& path) {
+    close();
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        std::cerr << "Cannot open " << path << "\n";
+        return false;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        ::close(fd);
+        return false;
+    }
+
+    // The mapping keeps its own reference to the file, the descriptor is not needed past this point
+    void* p = mmap(nullptr, static_cast<size_t>(st.st_size), PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (p == MAP_FAILED) {
+        std::cerr << "Cannot map " << path << "\n";
+        return false;
+    }
+    madvise(p, static_cast<size_t>(st.st_size), MADV_SEQUENTIAL);
+
+    bytes = static_cast<const char*>(p);
+    length = static_cast<size_t>(st.st_size);
+    return true;
+}
+
+inline void mapped_file::close() {
+    if (bytes)
+        munmap(const_cast<char*>(bytes), length);
+    bytes = nullptr;
+    length = 0;
+}
+
+#endif
+
+// Size and modification time of a file, false if it does not exist. The time is in the finest unit the
+// file system keeps (100 ns ticks on Windows, nanoseconds elsewhere), so an edit within the same second
+// still changes the signature.
+inline bool file_signature(const std::string& path, uint64_t& size, int64_t& mtime) {
+#ifdef _WIN32
+    WIN32_FILE_ATTRIBUTE_DATA data;
+    if (!GetFileAttributesExA(path.c_str(), GetFileExInfoStandard, &data))
+        return false;
+    size = static_cast<uint64_t>(data.nFileSizeHigh) << 32 | data.nFileSizeLow;
+    mtime = static_cast<int64_t>(static_cast<uint64_t>(data.ftLastWriteTime.dwHighDateTime) << 32
+        | data.ftLastWriteTime.dwLowDateTime);
+#else
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0)
+        return false;
+    size = static_cast<uint64_t>(st.st_size);
+#ifdef __APPLE__
+    mtime = static_cast<int64_t>(st.st_mtimespec.tv_sec) * 1000000000 + st.st_mtimespec.tv_nsec;
+#else
+    mtime = static_cast<int64_t>(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+#endif
+#endif
+    return true;
+}
+
+// Array that either owns its elements or views elements stored in a mapped file, which it keeps open.
+// Readers do not see the difference; writers go through edit(), which copies a view into owned storage.
+template <typename T>
+class mapped_array {
+    private:
+        std::vector<T> owned;
+        const T* view = nullptr;
+        size_t view_size = 0;
+        std::shared_ptr<const mapped_file> file;
+
+    public:
+        mapped_array() {}
+        mapped_array(std::vector<T> elements) : owned(std::move(elements)) {}
+        mapped_array(std::shared_ptr<const mapped_file> f, size_t offset, size_t count)
+            : view(reinterpret_cast<const T*>(f->data() + offset)), view_size(count), file(std::move(f)) {}
+
+        bool is_mapped() const { return view != nullptr; }
+        size_t size() const { return view ? view_size : owned.size(); }
+        bool empty() const { return size() == 0; }
+        const T* data() const { return view ? view : owned.data(); }
+        const T* begin() const { return data(); }
+        const T* end() const { return data() + size(); }
+        const T& operator[](size_t i) const { return data()[i]; }
+
+        std::vector<T>& edit() {
+            if (view) {
+                owned.assign(view, view + view_size);
+                view = nullptr;
+                view_size = 0;
+                file.reset();
+            }
+            return owned;
+        }
+};
+
+#endif
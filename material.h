@@ -2,37 +2,69 @@
 #define MATERIAL_H
 
 #include "hittable.h"
+#include "sampler.h"
 #include "texture.h"
 #include "utility.h"
 
 struct hit_record;
 
+// Type tag of the built-in materials, lets batched shading call them without virtual dispatch.
+// The built-in classes are final and pass their tag to the base; new materials derive from material,
+// keep none and are called through the virtual functions (dispatch.h).
+enum class material_kind : uint32_t { none, default_mat, lambertian, metal, dielectric, diffuse_light, count };
+
 // Class for material abstract class
 // Reference: Ray Tracing: The Next Week
 class material {
     public:
+        material(material_kind k = material_kind::none) : tag(k) {}
+
+        material_kind kind() const { return tag; }
+
+        // Scattered direction of a ray hitting rec, chosen with the sample u
         virtual bool scatter(
-            const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered
+            const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered, const sample2& u
         ) const = 0;
         virtual color getColor() const = 0;
         virtual color emitted(double u, double v, const point3& p) const {
             return color(0, 0, 0);
         }
+
+        // Solid angle density of scatter() choosing the direction of scattered. Zero for specular
+        // materials, which cannot be combined with light sampling.
+        // Reference: Ray Tracing: The Rest of Your Life
+        virtual double scatter_pdf(const ray& r_in, const hit_record& rec, const ray& scattered) const {
+            return 0;
+        }
+
+        // Fold the material into a scene key (see hittable::scene_key), textures by their color at the
+        // origin
+        virtual uint64_t scene_key(uint64_t key) const {
+            return scene_key_add(scene_key_add(key, static_cast<double>(kind())), getColor());
+        }
+
+    private:
+        material_kind tag;
 };
 
+// Fold a material that may be missing into a scene key
+inline uint64_t scene_key_add(uint64_t key, const material* m) {
+    return m ? m->scene_key(key) : scene_key_add(key, -1.0);
+}
+
 // Default material that mainly interacts with phong shading
-class default_mat : public material {
+class default_mat final : public material {
     public:
-        default_mat(const color& a) : albedo(make_shared<solid_color>(a)) {}
-        default_mat(shared_ptr<texture> a) : albedo(a) {}
+        default_mat(const color& a) : material(material_kind::default_mat), albedo(make_shared<solid_color>(a)) {}
+        default_mat(shared_ptr<texture> a) : material(material_kind::default_mat), albedo(a) {}
 
         virtual bool scatter(
-            const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered
+            const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered, const sample2& u
         ) const override {
             return false;
         }
         virtual color getColor() const override {
-            return albedo->value(0, 0, vec3());
+            return texture_value(*albedo, 0, 0, vec3());
         }
 
     public:
@@ -40,64 +72,77 @@ class default_mat : public material {
 };
 
 // Lambertian material, randomly reflects ray around surface normals
-class lambertian : public material {
+class lambertian final : public material {
 public:
-    lambertian(const color& a) : albedo(make_shared<solid_color>(a)) {}
-    lambertian(shared_ptr<texture> a) : albedo(a) {}
+    lambertian(const color& a) : material(material_kind::lambertian), albedo(make_shared<solid_color>(a)) {}
+    lambertian(shared_ptr<texture> a) : material(material_kind::lambertian), albedo(a) {}
 
     virtual bool scatter(
-        const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered
+        const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered, const sample2& u
     ) const override {
-        auto scatter_direction = unit_vector(1.1 * rec.normal + random_unit_vector());
-
-        // Catch degenerate scatter direction
-        if (scatter_direction.near_zero())
-            scatter_direction = rec.normal;
-
-        scattered = ray(rec.p, scatter_direction);
-        attenuation = albedo->value(rec.u, rec.v, rec.p);
+        // Cosine weighted direction, the density is given by scatter_pdf
+        scattered = ray(rec.p, cosine_direction(unit_vector(rec.normal), u.u, u.v));
+        attenuation = texture_value(*albedo, rec.u, rec.v, rec.p);
         return true;
     }
     virtual color getColor() const override {
-        return albedo->value(0, 0, vec3());
+        return texture_value(*albedo, 0, 0, vec3());
     }
     virtual color emitted(double u, double v, const point3& p) const override {
-        return 0.05 * albedo->value(u, v, p);
+        return 0.05 * texture_value(*albedo, u, v, p);
+    }
+    virtual double scatter_pdf(const ray& r_in, const hit_record& rec, const ray& scattered) const override {
+        auto cosine = dot(unit_vector(rec.normal), unit_vector(scattered.direction()));
+        return cosine < 0 ? 0 : cosine / pi;
     }
 
     public:
         shared_ptr<texture> albedo;
 };
 
+// Material of the meshes and triangles made without one, shared by all of them
+inline const material* default_material() {
+    static const lambertian mat(default_color);
+    return &mat;
+}
+
 // Metal meterial, reflects ray perfectly to represent a mirror feature
-class metal : public material {
+class metal final : public material {
     public:
-        metal(const color& a) : albedo(make_shared<solid_color>(a)) {}
-        metal(shared_ptr<texture> a) : albedo(a) {}
+        metal(const color& a) : material(material_kind::metal), albedo(make_shared<solid_color>(a)) {}
+        metal(shared_ptr<texture> a) : material(material_kind::metal), albedo(a) {}
 
         virtual bool scatter(
-            const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered
+            const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered, const sample2& u
         ) const override {
             vec3 reflected = reflect(unit_vector(r_in.direction()), rec.normal);
             scattered = ray(rec.p, reflected);
-            attenuation = albedo->value(rec.u, rec.v, rec.p);
+            attenuation = texture_value(*albedo, rec.u, rec.v, rec.p);
             return (dot(scattered.direction(), rec.normal) > 0);
         }
         virtual color getColor() const override {
-            return albedo->value(0, 0, vec3());
+            return texture_value(*albedo, 0, 0, vec3());
         }
 
     public:
         shared_ptr<texture> albedo;
 };
 
+// Fraction of light a dielectric reflects at the given cosine, the rest is refracted.
+// Uses Schlick's approximation for reflectance.
+inline double schlick_reflectance(double cosine, double ref_idx) {
+    auto r0 = (1 - ref_idx) / (1 + ref_idx);
+    r0 = r0 * r0;
+    return r0 + (1 - r0) * pow((1 - cosine), 5);
+}
+
 // Dielectric material, refract and reflect rays to allow transparency
-class dielectric : public material {
+class dielectric final : public material {
     public:
-        dielectric(double index_of_refraction) : ir(index_of_refraction) {}
+        dielectric(double index_of_refraction) : material(material_kind::dielectric), ir(index_of_refraction) {}
 
         virtual bool scatter(
-            const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered
+            const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered, const sample2& u
         ) const override {
             attenuation = color(1.0, 1.0, 1.0);
             double refraction_ratio = rec.front_face ? (1.0 / ir) : ir;
@@ -109,7 +154,7 @@ class dielectric : public material {
             bool cannot_refract = refraction_ratio * sin_theta > 1.0;
             vec3 direction;
 
-            if (cannot_refract || reflectance(cos_theta, refraction_ratio) > random_double())
+            if (cannot_refract || reflectance(cos_theta, refraction_ratio) > u.u)
                 direction = reflect(unit_direction, rec.normal);
             else
                 direction = refract(unit_direction, rec.normal, refraction_ratio);
@@ -120,35 +165,35 @@ class dielectric : public material {
         virtual color getColor() const override {
             return color(1, 1, 1);
         }
+        virtual uint64_t scene_key(uint64_t key) const override {
+            return scene_key_add(material::scene_key(key), ir);
+        }
 
     public:
         double ir; // Index of Refraction
 
     private:
         static double reflectance(double cosine, double ref_idx) {
-            // Use Schlick's approximation for reflectance.
-            auto r0 = (1 - ref_idx) / (1 + ref_idx);
-            r0 = r0 * r0;
-            return r0 + (1 - r0) * pow((1 - cosine), 5);
+            return schlick_reflectance(cosine, ref_idx);
         }
 };
 
 // Diffuse light material, represent area light
-class diffuse_light : public material {
+class diffuse_light final : public material {
     public:
-        diffuse_light(shared_ptr<texture> a) : emit(a) {}
-        diffuse_light(color c) : emit(make_shared<solid_color>(c)) {}
+        diffuse_light(shared_ptr<texture> a) : material(material_kind::diffuse_light), emit(a) {}
+        diffuse_light(color c) : material(material_kind::diffuse_light), emit(make_shared<solid_color>(c)) {}
 
         virtual bool scatter(
-            const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered
+            const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered, const sample2& u
         ) const override {
             return false;
         }
         virtual color emitted(double u, double v, const point3& p) const override {
-            return emit->value(u, v, p);
+            return texture_value(*emit, u, v, p);
         }
         virtual color getColor() const override {
-            return emit->value(0, 0, vec3());
+            return texture_value(*emit, 0, 0, vec3());
         }
 
     public:
@@ -1,111 +1,392 @@
 #ifndef OBJ_H
 #define OBJ_H
 
-#include <fstream>
+#include <algorithm>
+#include <cstdint>
 #include <iostream>
-#include <sstream>
 #include <string>
+#include <unordered_map>
 #include <vector>
 
+#include "mapped_file.h"
+#include "scene_arena.h"
+#include "scene_cache.h"
+#include "thread_pool.h"
+#include "triangle_mesh.h"
 #include "utility.h"
-#include "triangle.h"
+
+// Files above this size are parsed in chunks on the thread pool
+const size_t obj_parallel_threshold = 1 << 20;
+
+// Marks a face corner without a normal index
+const int32_t obj_no_normal = INT32_MIN;
+
+// Vertices, normals and triangulated faces parsed from one chunk of an obj file.
+// Negative (relative) indices are resolved against the counts inside the chunk. The corners listed in
+// relative_v and relative_vn still need the vertex and normal counts of all earlier chunks added.
+struct obj_chunk {
+	std::vector<float> positions;
+	std::vector<float> normals;
+	std::vector<int32_t> corner_v;
+	std::vector<int32_t> corner_vn;
+	std::vector<uint32_t> relative_v;
+	std::vector<uint32_t> relative_vn;
+	size_t bad_faces = 0;
+
+	size_t position_count() const { return positions.size() / 3; }
+	size_t normal_count() const { return normals.size() / 3; }
+};
+
+inline bool obj_is_space(char c) { return c == ' ' || c == '\t' || c == '\r'; }
+inline bool obj_is_digit(char c) { return c >= '0' && c <= '9'; }
+
+inline const char* obj_skip_spaces(const char* p, const char* end) {
+	while (p < end && obj_is_space(*p)) p++;
+	return p;
+}
+
+inline const char* obj_skip_line(const char* p, const char* end) {
+	while (p < end && *p != '\n') p++;
+	return p < end ? p + 1 : end;
+}
+
+// Parse a decimal integer, returns nullptr if there is none
+inline const char* obj_parse_int(const char* p, const char* end, int32_t& out) {
+	bool negative = false;
+	if (p < end && (*p == '-' || *p == '+')) {
+		negative = *p == '-';
+		p++;
+	}
+	if (p == end || !obj_is_digit(*p)) return nullptr;
+
+	int64_t value = 0;
+	while (p < end && obj_is_digit(*p)) {
+		if (value < INT32_MAX) value = value * 10 + (*p - '0');
+		p++;
+	}
+	out = static_cast<int32_t>(negative ? -std::min<int64_t>(value, INT32_MAX) : std::min<int64_t>(value, INT32_MAX));
+	return p;
+}
+
+// Parse a decimal real number with optional exponent, returns nullptr if there is none.
+// Up to 19 significant digits are gathered exactly in an integer and scaled by a single power of ten,
+// which is well within float precision and many times faster than strtod.
+inline const char* obj_parse_float(const char* p, const char* end, float& out) {
+	static const double powers[] = {
+		1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+		1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+	};
+
+	bool negative = false;
+	if (p < end && (*p == '-' || *p == '+')) {
+		negative = *p == '-';
+		p++;
+	}
+
+	uint64_t mantissa = 0;
+	int digits = 0;
+	int exponent = 0;
+	bool any = false;
+	for (; p < end && obj_is_digit(*p); p++) {
+		any = true;
+		if (digits < 19) {
+			mantissa = mantissa * 10 + (*p - '0');
+			if (mantissa > 0) digits++;
+		}
+		else
+			exponent++;
+	}
+	if (p < end && *p == '.') {
+		for (p++; p < end && obj_is_digit(*p); p++) {
+			any = true;
+			if (digits < 19) {
+				mantissa = mantissa * 10 + (*p - '0');
+				if (mantissa > 0) digits++;
+				exponent--;
+			}
+		}
+	}
+	if (!any) return nullptr;
+
+	if (p < end && (*p == 'e' || *p == 'E')) {
+		int32_t e;
+		const char* q = obj_parse_int(p + 1, end, e);
+		if (q) {
+			exponent += std::max(-400, std::min(400, static_cast<int>(e)));
+			p = q;
+		}
+	}
+
+	double value = static_cast<double>(mantissa);
+	if (exponent >= 0)
+		value *= exponent <= 22 ? powers[exponent] : std::pow(10.0, exponent);
+	else
+		value /= exponent >= -22 ? powers[-exponent] : std::pow(10.0, -exponent);
+	out = static_cast<float>(negative ? -value : value);
+	return p;
+}
+
+// Parse up to count reals into out, returns nullptr if fewer are found
+inline const char* obj_parse_floats(const char* p, const char* end, float* out, int count) {
+	for (int i = 0; i < count; i++) {
+		p = obj_parse_float(obj_skip_spaces(p, end), end, out[i]);
+		if (!p) return nullptr;
+	}
+	return p;
+}
+
+// Parse the lines in [p, end), which must start at the beginning of a line
+inline void obj_parse_chunk(const char* p, const char* end, obj_chunk& out) {
+	struct corner { int32_t v, vn; bool relative_v, relative_vn; };
+	std::vector<corner> polygon;
+
+	while (p < end) {
+		p = obj_skip_spaces(p, end);
+		if (p + 1 >= end) break;
+
+		if (p[0] == 'v' && obj_is_space(p[1])) {
+			float xyz[3];
+			if (obj_parse_floats(p + 1, end, xyz, 3))
+				out.positions.insert(out.positions.end(), xyz, xyz + 3);
+		}
+		else if (p[0] == 'v' && p[1] == 'n' && p + 2 < end && obj_is_space(p[2])) {
+			float xyz[3];
+			if (obj_parse_floats(p + 2, end, xyz, 3))
+				out.normals.insert(out.normals.end(), xyz, xyz + 3);
+		}
+		else if (p[0] == 'f' && obj_is_space(p[1])) {
+			// Corners are v, v/vt, v//vn or v/vt/vn. Indices start at 1, negative ones count back from
+			// the last vertex read so far. A '#' ends the corners, the rest of the line is a comment.
+			polygon.clear();
+			const char* q = p + 1;
+			bool valid = true;
+			while (true) {
+				q = obj_skip_spaces(q, end);
+				if (q == end || *q == '\n' || *q == '#') break;
+
+				corner c = { 0, obj_no_normal, false, false };
+				int32_t v, vt, vn;
+				const char* next = obj_parse_int(q, end, v);
+				if (!next || v == 0) { valid = false; break; }
+				q = next;
+				if (q < end && *q == '/') {
+					q++;
+					if (q < end && *q != '/') {
+						next = obj_parse_int(q, end, vt);
+						if (next) q = next;
+					}
+					if (q < end && *q == '/') {
+						next = obj_parse_int(q + 1, end, vn);
+						if (!next || vn == 0) { valid = false; break; }
+						q = next;
+						c.vn = vn > 0 ? vn - 1 : static_cast<int32_t>(out.normal_count()) + vn;
+						c.relative_vn = vn < 0;
+					}
+				}
+				c.v = v > 0 ? v - 1 : static_cast<int32_t>(out.position_count()) + v;
+				c.relative_v = v < 0;
+				polygon.push_back(c);
+			}
+
+			// Triangulate polygons as a fan around the first corner
+			if (!valid || polygon.size() < 3)
+				out.bad_faces++;
+			else {
+				for (size_t i = 1; i + 1 < polygon.size(); i++) {
+					const corner* tri[3] = { &polygon[0], &polygon[i], &polygon[i + 1] };
+					for (const corner* c : tri) {
+						uint32_t slot = static_cast<uint32_t>(out.corner_v.size());
+						if (c->relative_v) out.relative_v.push_back(slot);
+						if (c->relative_vn) out.relative_vn.push_back(slot);
+						out.corner_v.push_back(c->v);
+						out.corner_vn.push_back(c->vn);
+					}
+				}
+			}
+		}
+
+		// Texture coordinates, groups, materials and comments are skipped
+		p = obj_skip_line(p, end);
+	}
+}
 
 // Class for parsing obj file and computing per-vertex normals of obj file
+// The file is memory mapped and parsed in a single pass (in parallel chunks for large files), the
+// faces go into a single indexed triangle mesh. Faces without normals get smooth normals averaged
+// from the faces around each vertex.
+// The loaded mesh and its bvh are saved next to the file (<file>.cache) and mapped on later runs as long
+// as the file is unchanged. A material passed in replaces the one stored in the cache; without either the
+// mesh gets default_material().
+// The mesh is made in the scene's arena and lives as long as the scene.
 class obj {
 	public:
 		std::string fileName;
-		std::vector<point3> vertices;
-		std::vector<shared_ptr<triangle>> meshes;
-		std::vector<vec3> normals;
+		triangle_mesh* mesh = nullptr;
 
 	public:
 		obj() {}
-		obj(std::string filePath) {
+		obj(scene_arena& arena, std::string filePath, const material* m = nullptr, color c = default_color,
+			bool use_cache = true, thread_pool& pool = thread_pool::global())
+		{
 			fileName = filePath;
-			std::ifstream file(filePath);
-			std::string line;
-
-			// Iterate through the file line by line for parsing
-			while (std::getline(file, line)) {
-				// If line has vertex info
-				if (line.find("v") == 0) {
-					std::istringstream iss(line);
-					std::vector<std::string> parsed_double((
-						std::istream_iterator<std::string>(iss)),
-						std::istream_iterator<std::string>());
-					double x = std::stod(parsed_double[1]);
-					double y = std::stod(parsed_double[2]);
-					double z = std::stod(parsed_double[3]);
-
-					// Parse vertex position and push to vector
-					vertices.push_back(point3(x, y, z));
-					// Initialize per-vertex normal for the parsed vertex
-					normals.push_back(vec3(0, 0, 0));
-				}
+			mesh = arena.make<triangle_mesh>(m, c);
 
-				// If line has face info
-				else if (line.find("f") == 0) {
-					std::istringstream iss(line);
-					std::vector<std::string> parsed_int((
-						std::istream_iterator<std::string>(iss)),
-						std::istream_iterator<std::string>());
-					int v0 = std::stoi(parsed_int[1]) - 1;
-					int v1 = std::stoi(parsed_int[2]) - 1;
-					int v2 = std::stoi(parsed_int[3]) - 1;
-
-					// Construct triangle with parsed face info
-					shared_ptr<triangle> tri = make_shared<triangle>(vertices[v0], vertices[v1], vertices[v2], default_color);
-					vec3 n = tri->getFaceNormal();
-					// Compute vertex normal for each vertex
-					normals[v0] += n;
-					normals[v1] += n;
-					normals[v2] += n;
-					// Push triangle to vector
-					meshes.push_back(tri);
-				}
-
-				else
-					continue;
+			std::string cache_path = filePath + ".cache";
+			if (use_cache && load_scene_cache(cache_path, filePath, *mesh, arena)) {
+				mesh->objectColor = c;
+				return;
 			}
 
-			// Normalize all per-vertex normals
-			for (int i = 0; i < normals.size(); i++) {
-				normals[i] = unit_vector(normals[i]);
+			{
+				mapped_file file(filePath);
+				if (!file.is_open())
+					return;
+
+				std::vector<obj_chunk> chunks = parse(file.data(), file.data() + file.size(), pool);
+				assemble(chunks);
 			}
+			mesh->build_accel(pool);
 
-			file.close();
+			if (use_cache && !save_scene_cache(cache_path, filePath, *mesh))
+				std::cerr << "Cannot write scene cache " << cache_path << "\n";
 		}
 
-		std::vector<point3> getVertices() { return vertices; }
-		std::vector<shared_ptr<triangle>> getMeshes() { return meshes; }
+		triangle_mesh* getMesh() { return mesh; }
 
-		void update_vertex_normals();
+	private:
+		static std::vector<obj_chunk> parse(const char* begin, const char* end, thread_pool& pool);
+		void assemble(std::vector<obj_chunk>& chunks);
 };
 
-// Update all vertex normals in the triangles
-void obj::update_vertex_normals() {
-	std::ifstream file(fileName);
-	std::string line;
-	int tri_count = 0;
-
-	while (std::getline(file, line)) {
-		if (line.find("f") == 0) {
-			std::istringstream iss(line);
-			std::vector<std::string> parsed_int((
-				std::istream_iterator<std::string>(iss)),
-				std::istream_iterator<std::string>());
-			int v0 = std::stoi(parsed_int[1]) - 1;
-			int v1 = std::stoi(parsed_int[2]) - 1;
-			int v2 = std::stoi(parsed_int[3]) - 1;
-
-			// Update per-vertex normals in the triangle
-			meshes[tri_count]->normal_v0 = normals[v0];
-			meshes[tri_count]->normal_v1 = normals[v1];
-			meshes[tri_count]->normal_v2 = normals[v2];
-
-			tri_count++;
+// Split the file at line ends into one chunk per task and parse them concurrently
+std::vector<obj_chunk> obj::parse(const char* begin, const char* end, thread_pool& pool) {
+	size_t size = static_cast<size_t>(end - begin);
+	size_t count = 1;
+	if (size > obj_parallel_threshold && pool.size() > 1)
+		count = std::min<size_t>(4 * pool.size(), size / (obj_parallel_threshold / 4));
+
+	std::vector<const char*> bounds(count + 1);
+	bounds[0] = begin;
+	bounds[count] = end;
+	for (size_t c = 1; c < count; c++)
+		bounds[c] = std::max(bounds[c - 1], obj_skip_line(begin + size * c / count, end));
+
+	std::vector<obj_chunk> chunks(count);
+	task_group group(pool);
+	for (size_t c = 1; c < count; c++)
+		group.run([&, c]() { obj_parse_chunk(bounds[c], bounds[c + 1], chunks[c]); });
+	obj_parse_chunk(bounds[0], bounds[1], chunks[0]);
+	group.wait();
+	return chunks;
+}
+
+// Concatenate the chunks into the mesh. Corners are shared mesh vertices unless the file gives normals,
+// in which case every distinct (position, normal) pair becomes one mesh vertex.
+void obj::assemble(std::vector<obj_chunk>& chunks) {
+	size_t position_total = 0, normal_total = 0, corner_total = 0, bad_faces = 0;
+	for (obj_chunk& chunk : chunks) {
+		for (uint32_t slot : chunk.relative_v)
+			chunk.corner_v[slot] += static_cast<int32_t>(position_total);
+		for (uint32_t slot : chunk.relative_vn)
+			chunk.corner_vn[slot] += static_cast<int32_t>(normal_total);
+		position_total += chunk.position_count();
+		normal_total += chunk.normal_count();
+		corner_total += chunk.corner_v.size();
+		bad_faces += chunk.bad_faces;
+	}
+
+	std::vector<float> positions;
+	std::vector<float> normals;
+	positions.reserve(3 * position_total);
+	normals.reserve(3 * normal_total);
+	for (const obj_chunk& chunk : chunks) {
+		positions.insert(positions.end(), chunk.positions.begin(), chunk.positions.end());
+		normals.insert(normals.end(), chunk.normals.begin(), chunk.normals.end());
+	}
+
+	// Gather the faces with in-range indices
+	std::vector<uint32_t> face_v, face_vn;
+	face_v.reserve(corner_total);
+	if (normal_total > 0)
+		face_vn.reserve(corner_total);
+	bool missing_normals = false;
+	for (const obj_chunk& chunk : chunks) {
+		for (size_t i = 0; i < chunk.corner_v.size(); i += 3) {
+			bool valid = true;
+			for (size_t k = i; k < i + 3; k++) {
+				int32_t v = chunk.corner_v[k], vn = chunk.corner_vn[k];
+				valid = valid && v >= 0 && static_cast<size_t>(v) < position_total
+					&& (vn == obj_no_normal || (vn >= 0 && static_cast<size_t>(vn) < normal_total));
+			}
+			if (!valid) {
+				bad_faces++;
+				continue;
+			}
+			for (size_t k = i; k < i + 3; k++) {
+				face_v.push_back(static_cast<uint32_t>(chunk.corner_v[k]));
+				if (normal_total > 0) {
+					face_vn.push_back(static_cast<uint32_t>(chunk.corner_vn[k]));
+					missing_normals = missing_normals || chunk.corner_vn[k] == obj_no_normal;
+				}
+			}
+		}
+	}
+	chunks.clear();
+	if (bad_faces > 0)
+		std::cerr << "Skipped " << bad_faces << " malformed faces in " << fileName << "\n";
+
+	std::vector<float> x(position_total), y(position_total), z(position_total);
+	for (size_t i = 0; i < position_total; i++) {
+		x[i] = positions[3 * i];
+		y[i] = positions[3 * i + 1];
+		z[i] = positions[3 * i + 2];
+	}
+	mesh->px = std::move(x);
+	mesh->py = std::move(y);
+	mesh->pz = std::move(z);
+	mesh->indices = std::move(face_v);
+	if (normal_total == 0 || missing_normals)
+		mesh->compute_vertex_normals();
+	if (normal_total == 0)
+		return;
+
+	// Split the vertices by the normals given in the file. Corners without a normal keep the smooth
+	// normal of their position.
+	std::vector<float> px, py, pz, nx, ny, nz;
+	std::unordered_map<uint64_t, uint32_t> vertex_of;
+	vertex_of.reserve(position_total);
+	std::vector<uint32_t>& indices = mesh->indices.edit();
+	for (size_t k = 0; k < indices.size(); k++) {
+		uint32_t v = indices[k];
+		uint32_t vn = face_vn[k];
+		uint64_t key = static_cast<uint64_t>(v) << 32 | vn;
+		auto found = vertex_of.emplace(key, static_cast<uint32_t>(px.size()));
+		if (found.second) {
+			px.push_back(mesh->px[v]);
+			py.push_back(mesh->py[v]);
+			pz.push_back(mesh->pz[v]);
+			if (vn == static_cast<uint32_t>(obj_no_normal)) {
+				nx.push_back(mesh->nx[v]);
+				ny.push_back(mesh->ny[v]);
+				nz.push_back(mesh->nz[v]);
+			}
+			else {
+				vec3 n(normals[3 * vn], normals[3 * vn + 1], normals[3 * vn + 2]);
+				if (n.length_squared() > 0)
+					n = unit_vector(n);
+				nx.push_back(static_cast<float>(n.x()));
+				ny.push_back(static_cast<float>(n.y()));
+				nz.push_back(static_cast<float>(n.z()));
+			}
 		}
+		indices[k] = found.first->second;
 	}
+	mesh->px = std::move(px);
+	mesh->py = std::move(py);
+	mesh->pz = std::move(pz);
+	mesh->nx = std::move(nx);
+	mesh->ny = std::move(ny);
+	mesh->nz = std::move(nz);
 }
 
-#endif OBJ_H
\ No newline at end of file
+#endif // !OBJ_H
@@ -2,26 +2,33 @@
 #define PLANE_H
 
 #include "hittable.h"
+#include "material.h"
 #include "vec3.h"
 
 // Class for plane hittable object
-class plane : public hittable {
+class plane final : public hittable {
 	public:
 		point3 point;
 		vec3 normal;
-		shared_ptr<material> mat_ptr;
+		const material* mat_ptr;
 	
 	public:
-		plane() {}
-		plane(point3 a, vec3 n, shared_ptr<material> m) : point(a), normal(n), mat_ptr(m) {};
+		plane() : hittable(primitive_kind::plane) {}
+		plane(point3 a, vec3 n, const material* m) : hittable(primitive_kind::plane), point(a), normal(unit_vector(n)), mat_ptr(m) {};
 
 		virtual bool hit(
-			const ray& r, double t_min, double t_max, hit_record& rec) const override;
+			const ray& r, real t_min, real t_max, hit_record& rec) const override;
+		virtual bool occluded(const ray& r, real t_min, real t_max) const override;
 		virtual bool bounding_box(double time0, double time1, aabb& output_box) const override;
+		virtual const material* get_material() const override { return mat_ptr; }
+		virtual uint64_t scene_key(uint64_t key) const override {
+			key = scene_key_add(scene_key_add(hittable::scene_key(key), point), normal);
+			return scene_key_add(key, mat_ptr);
+		}
 };
 
 // Check if ray hit the plane
-bool plane::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
+bool plane::hit(const ray& r, real t_min, real t_max, hit_record& rec) const {
 	vec3 a_o = point - r.origin();
 	auto numerator = dot(a_o, normal);
 	auto denominator = dot(r.direction(), normal);
@@ -29,7 +36,7 @@ bool plane::hit(const ray& r, double t_min, double t_max, hit_record& rec) const
 	// No hit if ray if in parallel with plane
 	if (denominator == 0) return false;
 	auto ray_t = numerator / denominator;
-	if (ray_t < t_min || t_max < ray_t) return false;
+	if (!(ray_t >= t_min && ray_t <= t_max)) return false;
 	
 	// Update hit record
 	rec.t = ray_t;
@@ -43,6 +50,13 @@ bool plane::hit(const ray& r, double t_min, double t_max, hit_record& rec) const
 	return true;
 }
 
+bool plane::occluded(const ray& r, real t_min, real t_max) const {
+	auto denominator = dot(r.direction(), normal);
+	if (denominator == 0) return false;
+	auto ray_t = dot(point - r.origin(), normal) / denominator;
+	return ray_t >= t_min && ray_t <= t_max;
+}
+
 // Return boudning box of place
 bool plane::bounding_box(double time0, double time1, aabb& output_box) const {
 	// Plane does not have bounding box since it is infinite
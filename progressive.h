@@ -0,0 +1,190 @@
+#ifndef PROGRESSIVE_H
+#define PROGRESSIVE_H
+
+#include "camera.h"
+#include "hittable.h"
+#include "sampler.h"
+#include "tile_renderer.h"
+#include "utility.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+// Checkpoint file: a header followed by the color sums (one padded color per pixel) and the sample count
+// of every pixel, in native byte order. The values of a sample depend on its pixel, its index and the
+// sampler settings in the scene key alone, so the counts are the complete generator state: a resumed
+// render draws exactly the samples the interrupted one would have drawn next and ends with the same image.
+const char accumulation_magic[8] = { 'M', 'P', '3', 'A', 'C', 'C', 'U', 'M' };
+const uint32_t accumulation_version = 2;
+
+struct accumulation_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t width;
+    uint32_t height;
+    uint32_t color_size;
+    uint64_t scene_key;
+};
+
+// Fold the view of a camera into a scene key: the rays through three corners fix the pinhole
+inline uint64_t scene_key_add(uint64_t key, const camera& cam) {
+    const double corners[3][2] = { { 0, 0 }, { 1, 0 }, { 0, 1 } };
+    for (const auto& c : corners) {
+        ray r = cam.get_ray(c[0], c[1]);
+        key = scene_key_add(scene_key_add(key, r.origin()), r.direction());
+    }
+    return key;
+}
+
+// Fold the sample values into a scene key: the sampler type and seed, and for the patterned samplers the
+// pattern size, which decides the strata every sample index lands in. Their checkpoints therefore only
+// resume for the same samples per pixel and cannot be extended.
+inline uint64_t scene_key_add(uint64_t key, const sampler& s) {
+    key = scene_key_add(scene_key_add(key, static_cast<double>(s.get_type())), static_cast<double>(s.get_seed()));
+    if (s.get_type() == sampler_type::stratified || s.get_type() == sampler_type::cmj)
+        key = scene_key_add(key, static_cast<double>(s.get_pattern_size()));
+    return key;
+}
+
+// Class for the floating-point sums of a progressive render and the samples behind every pixel.
+// scene_key identifies the scene and settings; a checkpoint of anything else is not resumed.
+class accumulation_buffer {
+    public:
+        framebuffer sums;
+        std::vector<uint32_t> counts;
+        uint64_t scene_key;
+
+    public:
+        accumulation_buffer(int w, int h, uint64_t key)
+            : sums(w, h), counts(static_cast<size_t>(w) * h), scene_key(key) {}
+
+        // Samples every pixel has, passes add the same count to all of them
+        uint32_t completed_samples() const;
+
+        color average(int x, int y) const {
+            uint32_t n = counts[static_cast<size_t>(y) * sums.width + x];
+            return n > 0 ? sums.at(x, y) / n : color(0, 0, 0);
+        }
+
+        bool save(const std::string& path) const;
+        bool load(const std::string& path);
+};
+
+inline uint32_t accumulation_buffer::completed_samples() const {
+    uint32_t n = counts.empty() ? 0 : counts[0];
+    for (uint32_t c : counts)
+        n = std::min(n, c);
+    return n;
+}
+
+// Written under a temporary name and renamed, so a crash while saving leaves the last checkpoint intact
+inline bool accumulation_buffer::save(const std::string& path) const {
+    accumulation_header header;
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.magic, accumulation_magic, sizeof(header.magic));
+    header.version = accumulation_version;
+    header.width = static_cast<uint32_t>(sums.width);
+    header.height = static_cast<uint32_t>(sums.height);
+    header.color_size = sizeof(color);
+    header.scene_key = scene_key;
+
+    std::string temp_path = path + ".tmp";
+    {
+        std::ofstream out(temp_path, std::ios::binary | std::ios::trunc);
+        if (!out)
+            return false;
+        out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        out.write(reinterpret_cast<const char*>(sums.pixels.data()), static_cast<std::streamsize>(sums.pixels.size() * sizeof(color)));
+        out.write(reinterpret_cast<const char*>(counts.data()), static_cast<std::streamsize>(counts.size() * sizeof(uint32_t)));
+        if (!out) {
+            out.close();
+            std::remove(temp_path.c_str());
+            return false;
+        }
+    }
+
+    // rename replaces an existing file atomically on POSIX, Windows needs it removed first
+    if (std::rename(temp_path.c_str(), path.c_str()) != 0) {
+        std::remove(path.c_str());
+        if (std::rename(temp_path.c_str(), path.c_str()) != 0) {
+            std::remove(temp_path.c_str());
+            return false;
+        }
+    }
+    return true;
+}
+
+// Load a checkpoint of the same image size and scene, false leaves the buffer untouched
+inline bool accumulation_buffer::load(const std::string& path) {
+    std::ifstream in(path, std::ios::binary);
+    if (!in)
+        return false;
+
+    accumulation_header header;
+    if (!in.read(reinterpret_cast<char*>(&header), sizeof(header))
+        || std::memcmp(header.magic, accumulation_magic, sizeof(header.magic)) != 0
+        || header.version != accumulation_version
+        || header.width != static_cast<uint32_t>(sums.width)
+        || header.height != static_cast<uint32_t>(sums.height)
+        || header.color_size != sizeof(color)
+        || header.scene_key != scene_key) {
+        std::cerr << "Ignoring checkpoint " << path << " of another render\n";
+        return false;
+    }
+
+    std::vector<color> loaded_sums(sums.pixels.size());
+    std::vector<uint32_t> loaded_counts(counts.size());
+    in.read(reinterpret_cast<char*>(loaded_sums.data()), static_cast<std::streamsize>(loaded_sums.size() * sizeof(color)));
+    in.read(reinterpret_cast<char*>(loaded_counts.data()), static_cast<std::streamsize>(loaded_counts.size() * sizeof(uint32_t)));
+    if (!in) {
+        std::cerr << "Checkpoint " << path << " is truncated\n";
+        return false;
+    }
+
+    sums.pixels.swap(loaded_sums);
+    counts.swap(loaded_counts);
+    return true;
+}
+
+// Render in passes of pass_samples samples until every pixel of acc has target_samples, starting
+// wherever acc left off. render_pass(first, count) adds samples [first, first + count) of every pixel
+// to acc.sums. The buffer is saved to checkpoint_path after a pass once checkpoint_seconds have passed
+// since the last save, and at the end; an empty path disables checkpoints.
+template <typename F>
+void render_progressive(accumulation_buffer& acc, int target_samples, int pass_samples,
+    const std::string& checkpoint_path, double checkpoint_seconds, F render_pass)
+{
+    typedef std::chrono::steady_clock clock;
+    clock::time_point last_save = clock::now();
+
+    uint32_t done = acc.completed_samples();
+    if (done > 0)
+        std::cerr << "Resuming at " << done << " samples per pixel\n";
+
+    uint32_t target = static_cast<uint32_t>(target_samples);
+    while (done < target) {
+        uint32_t count = std::min(static_cast<uint32_t>(pass_samples), target - done);
+        render_pass(done, count);
+        for (uint32_t& n : acc.counts)
+            n += count;
+        done += count;
+        std::cerr << "\rSamples per pixel: " << done << " of " << target_samples << ' ' << std::flush;
+
+        double since_save = std::chrono::duration<double>(clock::now() - last_save).count();
+        bool last = done >= target;
+        if (!checkpoint_path.empty() && (last || since_save >= checkpoint_seconds)) {
+            if (!acc.save(checkpoint_path))
+                std::cerr << "\nCannot write checkpoint " << checkpoint_path << "\n";
+            last_save = clock::now();
+        }
+    }
+}
+
+#endif
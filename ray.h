@@ -5,24 +5,37 @@
 
 // Class for ray initialization
 // Reference: Ray Tracing in One Weekend
+// The reciprocal direction and the direction sign bits are computed once here, every box test of the
+// acceleration structures reads them instead of dividing again.
 class ray {
 	public:
 		point3 orig;
 		vec3 dir;
+		vec3 inv_dir;
+		int sign[3];
 
 	public:
-		ray() {}
+		ray() : sign{ 0, 0, 0 } {}
 		ray(const point3& origin, const vec3& direction)
-			: orig(origin), dir(direction)
-		{}
+			: orig(origin), dir(direction),
+			  inv_dir(reciprocal(direction))
+		{
+			sign[0] = inv_dir.x() < 0;
+			sign[1] = inv_dir.y() < 0;
+			sign[2] = inv_dir.z() < 0;
+		}
+
+		const point3& origin() const { return orig; }
+		const vec3& direction() const { return dir; }
+		const vec3& inverse_direction() const { return inv_dir; }
 
-		point3 origin() const { return orig; }
-		vec3 direction() const { return dir; }
+		// 1 if the direction is negative along the axis
+		const int* dir_is_neg() const { return sign; }
 
 		// Return the point of ray hit given t
-		point3 at(double t) const {
+		point3 at(real t) const {
 			return orig + t * dir;
 		}
 };
 
-#endif
\ No newline at end of file
+#endif
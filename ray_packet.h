@@ -0,0 +1,101 @@
+#ifndef RAY_PACKET_H
+#define RAY_PACKET_H
+
+#include "utility.h"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+// Bundle of coherent rays (usually the camera rays of a small block of pixels) traced through the
+// acceleration structure together, so every node is fetched once for the whole bundle.
+struct ray_packet {
+    static const int max_size = 16;
+
+    int size = 0;
+    ray rays[max_size];
+
+    void add(const ray& r) { rays[size++] = r; }
+
+    // True if every ray points the same way along every axis. Interval culling of a node against the
+    // whole packet only pays off in that case. A ray parallel to an axis plane (or nearly so, with a
+    // reciprocal beyond the float range) counts as mixed: its infinite reciprocal, of either sign for
+    // -0, would turn the interval products into 0 * inf = NaN, so such packets go ray by ray.
+    bool same_direction_signs() const {
+        for (int a = 0; a < 3; a++) {
+            int neg = rays[0].dir_is_neg()[a];
+            for (int k = 0; k < size; k++) {
+                float inv = static_cast<float>(rays[k].inverse_direction()[a]);
+                if (rays[k].dir_is_neg()[a] != neg || !(std::fabs(inv) < std::numeric_limits<float>::infinity()))
+                    return false;
+            }
+        }
+        return true;
+    }
+};
+
+// Interval bounds of the origins and reciprocal directions of a packet, used to reject a box for
+// every ray of the packet with a single conservative test (interval arithmetic).
+// Reference: Boulos et al., Geometric and Arithmetic Culling Methods for Entire Ray Packets
+struct packet_bounds {
+    float orig_lo[3], orig_hi[3];
+    float inv_lo[3], inv_hi[3];
+
+    packet_bounds(const ray_packet& packet) {
+        for (int a = 0; a < 3; a++) {
+            orig_lo[a] = inv_lo[a] = std::numeric_limits<float>::infinity();
+            orig_hi[a] = inv_hi[a] = -std::numeric_limits<float>::infinity();
+            for (int k = 0; k < packet.size; k++) {
+                float o = static_cast<float>(packet.rays[k].origin()[a]);
+                float inv = static_cast<float>(packet.rays[k].inverse_direction()[a]);
+                orig_lo[a] = std::min(orig_lo[a], o);
+                orig_hi[a] = std::max(orig_hi[a], o);
+                inv_lo[a] = std::min(inv_lo[a], inv);
+                inv_hi[a] = std::max(inv_hi[a], inv);
+            }
+        }
+    }
+
+    // Classify a box against the whole packet: every ray hits it within [t_near_max, t_min_far] bounds,
+    // no ray hits it within [t_min, t_far], or anything in between. t_near receives a lower bound of the
+    // entry distance of all rays. pad is an absolute slack of the distances on top of the relative one.
+    enum coverage { miss_all, hit_some, hit_all };
+
+    coverage classify(const float box_min[3], const float box_max[3],
+        float t_min, float t_max_lo, float t_max_hi, float pad, float& t_near) const
+    {
+        float near_lo = t_min, near_hi = t_min;
+        float far_lo = t_max_lo, far_hi = t_max_hi;
+        for (int a = 0; a < 3; a++) {
+            // Distances to both slabs as intervals: (plane - [orig]) * [inv]
+            float lo0, hi0, lo1, hi1;
+            interval_mul(box_min[a] - orig_hi[a], box_min[a] - orig_lo[a], inv_lo[a], inv_hi[a], lo0, hi0);
+            interval_mul(box_max[a] - orig_hi[a], box_max[a] - orig_lo[a], inv_lo[a], inv_hi[a], lo1, hi1);
+
+            // With all directions of one sign the entering slab is the same for every ray
+            bool neg = inv_lo[a] < 0;
+            near_lo = std::max(near_lo, neg ? lo1 : lo0);
+            near_hi = std::max(near_hi, neg ? hi1 : hi0);
+            far_lo = std::min(far_lo, neg ? lo0 : lo1);
+            far_hi = std::min(far_hi, neg ? hi0 : hi1);
+        }
+        t_near = near_lo;
+
+        // Leave room for the rounding of the interval products
+        const float slack = 4 * std::numeric_limits<float>::epsilon();
+        if (near_lo - slack * std::fabs(near_lo) > far_hi + slack * std::fabs(far_hi) + pad)
+            return miss_all;
+        if (near_hi + slack * std::fabs(near_hi) + pad <= far_lo - slack * std::fabs(far_lo))
+            return hit_all;
+        return hit_some;
+    }
+
+    private:
+        static void interval_mul(float a, float b, float c, float d, float& lo, float& hi) {
+            float p0 = a * c, p1 = a * d, p2 = b * c, p3 = b * d;
+            lo = std::min(std::min(p0, p1), std::min(p2, p3));
+            hi = std::max(std::max(p0, p1), std::max(p2, p3));
+        }
+};
+
+#endif
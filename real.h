@@ -0,0 +1,26 @@
+#ifndef REAL_H
+#define REAL_H
+
+#include <limits>
+
+// Scalar type of the math core: vectors, rays, boxes, hit distances and the primitive tests.
+// Double by default; define RT_SINGLE_PRECISION for float, which halves the size of everything
+// built from vec3 and doubles the lanes per SIMD register. Sampling and densities stay double.
+#ifdef RT_SINGLE_PRECISION
+typedef float real;
+#else
+typedef double real;
+#endif
+
+constexpr real real_epsilon = std::numeric_limits<real>::epsilon();
+
+// Bound on the relative rounding error of n chained operations in real, gamma(n) of PBR 3.9.1
+constexpr real rounding_bound(int n) {
+    return (n * real_epsilon / 2) / (1 - n * real_epsilon / 2);
+}
+
+// A ray counts as parallel to a triangle when the cosine between the triangle's first edge and
+// direction x second edge is below this; relative, so it holds at any scale of the mesh
+constexpr real parallel_cosine = 64 * real_epsilon;
+
+#endif
@@ -0,0 +1,64 @@
+#ifndef RNG_H
+#define RNG_H
+
+#include <cstdint>
+
+// Class for a small and fast random number generator (PCG32, see pcg-random.org).
+// The independent sampler (sampler.h) seeds one generator per pixel sample from a hash of (pixel, sample),
+// and the path then draws from it bounce after bounce, so every image is bit-identical no matter how
+// many threads render it or in which order the tiles finish.
+class rng {
+    private:
+        uint64_t state;
+        uint64_t inc;
+
+    public:
+        rng(uint64_t seed = 0x853c49e6748fea9bULL, uint64_t stream = 0xda3e39cb94b95bdbULL) {
+            state = 0;
+            inc = (stream << 1u) | 1u;
+            next_u32();
+            state += seed;
+            next_u32();
+        }
+
+        // Generator for one camera sample of pixel (x, y)
+        static rng for_sample(uint32_t x, uint32_t y, uint32_t sample, uint64_t seed = 0) {
+            uint64_t key = mix(seed ^ (static_cast<uint64_t>(x) << 32 | y));
+            return rng(mix(key ^ sample), key);
+        }
+
+        uint32_t next_u32() {
+            uint64_t old = state;
+            state = old * 6364136223846793005ULL + inc;
+            uint32_t xorshifted = static_cast<uint32_t>(((old >> 18u) ^ old) >> 27u);
+            uint32_t rot = static_cast<uint32_t>(old >> 59u);
+            return (xorshifted >> rot) | (xorshifted << ((~rot + 1u) & 31));
+        }
+
+        // Returns a random real in [0,1).
+        double next_double() {
+            return next_u32() * (1.0 / 4294967296.0);
+        }
+
+        // Returns a random integer in [0,bound).
+        uint32_t next_bounded(uint32_t bound) {
+            return static_cast<uint32_t>((static_cast<uint64_t>(next_u32()) * bound) >> 32);
+        }
+
+        // 64-bit finalizer of SplitMix64, scrambles keys into well distributed seeds
+        static uint64_t mix(uint64_t z) {
+            z += 0x9e3779b97f4a7c15ULL;
+            z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+            z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+            return z ^ (z >> 31);
+        }
+};
+
+// Generator of the calling thread for code outside the sampling paths (scene setup and the like).
+// Fixed seed, so scenes built from random values are the same on every run.
+inline rng& thread_rng() {
+    static thread_local rng gen;
+    return gen;
+}
+
+#endif
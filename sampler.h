@@ -0,0 +1,264 @@
+#ifndef SAMPLER_H
+#define SAMPLER_H
+
+#include "rng.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+
+// Point of the unit square [0,1)^2
+struct sample2 {
+    double u;
+    double v;
+};
+
+enum class sampler_type { independent, stratified, cmj, sobol, blue_noise };
+
+// Dimensions of one path sample. Every bounce has its own fixed dimensions, so the BSDF sample at depth 2
+// comes from the same dimensions whether or not the bounce before sampled a light or played roulette.
+const int pixel_dimension = 0;          // Position inside the pixel (2)
+const int lens_dimension = 2;           // Position on the lens (2), unused by the pinhole camera
+const int bounce_dimension = 4;         // First dimension of the first bounce
+const int dimensions_per_bounce = 5;    // BSDF (2), light (2) and Russian roulette (1)
+
+// Hashes and sequences the sampler is built from
+namespace sequence {
+
+inline uint32_t reverse_bits(uint32_t x) {
+    x = (x << 16) | (x >> 16);
+    x = ((x & 0x00ff00ffu) << 8) | ((x & 0xff00ff00u) >> 8);
+    x = ((x & 0x0f0f0f0fu) << 4) | ((x & 0xf0f0f0f0u) >> 4);
+    x = ((x & 0x33333333u) << 2) | ((x & 0xccccccccu) >> 2);
+    x = ((x & 0x55555555u) << 1) | ((x & 0xaaaaaaaau) >> 1);
+    return x;
+}
+
+// Second dimension of the Sobol sequence with its bits in reverse order, the first dimension in reverse
+// order is i itself. The scrambling below works on reversed bits, so this saves reversing twice.
+inline uint32_t sobol_1_reversed(uint32_t i) {
+    uint32_t r = 0;
+    for (uint32_t v = 1; i; i >>= 1, v ^= v << 1) {
+        if (i & 1)
+            r ^= v;
+    }
+    return r;
+}
+
+// Owen scrambling: every bit is flipped by a hash of the bits above it
+// Reference: Burley, Practical Hash-based Owen Scrambling
+inline uint32_t laine_karras_permutation(uint32_t x, uint32_t seed) {
+    x += seed;
+    x ^= x * 0x6c50b47cu;
+    x ^= x * 0xb82f1e52u;
+    x ^= x * 0xc7afe638u;
+    x ^= x * 0x8d22f6e6u;
+    return x;
+}
+
+inline uint32_t nested_uniform_scramble(uint32_t x, uint32_t seed) {
+    return reverse_bits(laine_karras_permutation(reverse_bits(x), seed));
+}
+
+// Owen-scrambled point of [0,1) given with its bits in reverse order
+inline double owen_scrambled(uint32_t reversed, uint32_t seed) {
+    return reverse_bits(laine_karras_permutation(reversed, seed)) * (1.0 / 4294967296.0);
+}
+
+// Element i of a random permutation of [0, l) selected by p, without a table
+// Reference: Kensler, Correlated Multi-Jittered Sampling
+inline uint32_t permute(uint32_t i, uint32_t l, uint32_t p) {
+    uint32_t w = l - 1;
+    w |= w >> 1;
+    w |= w >> 2;
+    w |= w >> 4;
+    w |= w >> 8;
+    w |= w >> 16;
+    do {
+        i ^= p;
+        i *= 0xe170893du;
+        i ^= p >> 16;
+        i ^= (i & w) >> 4;
+        i ^= p >> 8;
+        i *= 0x0929eb3fu;
+        i ^= p >> 23;
+        i ^= (i & w) >> 1;
+        i *= 1 | p >> 27;
+        i *= 0x6935fa69u;
+        i ^= (i & w) >> 11;
+        i *= 0x74dcb303u;
+        i ^= (i & w) >> 2;
+        i *= 0x9e501cc3u;
+        i ^= (i & w) >> 2;
+        i *= 0xc860a3dfu;
+        i &= w;
+        i ^= i >> 5;
+    } while (i >= l);
+    return (i + p) % l;
+}
+
+// Real in [0,1) hashed from i and p
+inline double hash_double(uint32_t i, uint32_t p) {
+    i ^= p;
+    i ^= i >> 17;
+    i ^= i >> 10;
+    i *= 0xb36534e5u;
+    i ^= i >> 12;
+    i ^= i >> 21;
+    i *= 0x93fc4795u;
+    i ^= 0xdf6e307fu;
+    i ^= i >> 17;
+    i *= 1 | p >> 18;
+    return i * (1.0 / 4294967296.0);
+}
+
+inline double fract(double x) {
+    return x - std::floor(x);
+}
+
+}
+
+// Class for the sample values of one path. A sampler is copied from a configured prototype for every
+// pixel sample and started there; each sample of the path is then computed on the fly from hashes of
+// (pixel, sample index, dimension), when the path asks for it. Nothing is allocated or stored per pixel,
+// and the values never depend on the thread or the order of work.
+// - independent: uniform random values, the plain Monte Carlo estimator; drawn in the order asked for
+// - stratified: jittered strata in every dimension, the 2D strata on a grid of any size
+// - cmj: correlated multi-jittered, stratified in 2D and in both 1D projections
+// - sobol: Owen-scrambled Sobol points, shuffled per pixel; good at any sample count
+// - blue_noise: the Sobol points of every pixel share their scrambling and are shifted by a per-pixel
+//   offset, so the error of neighbouring pixels differs and shows up as fine blue noise
+// Stratified and multi-jittered patterns hold samples_per_pixel samples; samples beyond start new
+// patterns. Dimensions are paired for 2D samples and the pairs are decorrelated by their seeds.
+// Reference: Physically Based Rendering, chapter 8 Sampling and Reconstruction
+class sampler {
+    public:
+        sampler(sampler_type t = sampler_type::sobol, int samples_per_pixel = 1, uint32_t seed = 0);
+
+        sampler_type get_type() const { return type; }
+        uint32_t get_seed() const { return seed; }
+        uint32_t get_pattern_size() const { return pattern_size; }
+
+        // Begin sample index of pixel (x, y)
+        void start(uint32_t x, uint32_t y, uint32_t index);
+
+        // Samples of the dimension layout above, depth counts from one at the camera ray's hit
+        sample2 pixel_sample() { return get_2d(pixel_dimension); }
+        sample2 lens_sample() { return get_2d(lens_dimension); }
+        sample2 bsdf_sample(int depth) { return get_2d(bounce_dimension + (depth - 1) * dimensions_per_bounce); }
+        sample2 light_sample(int depth) { return get_2d(bounce_dimension + (depth - 1) * dimensions_per_bounce + 2); }
+        double roulette_sample(int depth) { return get_1d(bounce_dimension + (depth - 1) * dimensions_per_bounce + 4); }
+
+        // Sample of dimension d, or of the pair (d, d + 1)
+        double get_1d(int d);
+        sample2 get_2d(int d);
+
+    private:
+        sampler_type type;
+        uint32_t pattern_size;
+        uint32_t grid_x, grid_y;    // Cells of the 2D strata, at least pattern_size of them
+        uint32_t seed;
+
+        uint32_t px = 0, py = 0;
+        uint32_t index = 0;
+        uint64_t pixel_key = 0;
+        rng gen;
+
+        uint64_t dimension_key(int d, uint32_t pattern) const {
+            return rng::mix(pixel_key ^ (static_cast<uint64_t>(d) << 32 | pattern));
+        }
+
+        // Per-pixel offset of the blue-noise sampler: the R2 sequence over the pixel grid
+        // Reference: Roberts, The Unreasonable Effectiveness of Quasirandom Sequences
+        double pixel_offset(uint32_t a, uint32_t b, int d) const {
+            return sequence::fract(0.7548776662466927 * a + 0.5698402909980532 * b + 0.6180339887498949 * d);
+        }
+};
+
+inline sampler::sampler(sampler_type t, int samples_per_pixel, uint32_t seed)
+    : type(t), pattern_size(static_cast<uint32_t>(std::max(samples_per_pixel, 1))), seed(seed)
+{
+    grid_x = std::max(1u, static_cast<uint32_t>(std::sqrt(static_cast<double>(pattern_size))));
+    grid_y = (pattern_size + grid_x - 1) / grid_x;
+}
+
+inline void sampler::start(uint32_t x, uint32_t y, uint32_t sample_index) {
+    px = x;
+    py = y;
+    index = sample_index;
+    if (type == sampler_type::blue_noise)
+        pixel_key = rng::mix(seed);
+    else
+        pixel_key = rng::mix(seed ^ (static_cast<uint64_t>(x) << 32 | y));
+    if (type == sampler_type::independent)
+        gen = rng::for_sample(x, y, sample_index, seed);
+}
+
+inline double sampler::get_1d(int d) {
+    switch (type) {
+        case sampler_type::stratified:
+        case sampler_type::cmj: {
+            uint32_t s = index % pattern_size;
+            uint64_t key = dimension_key(d, index / pattern_size);
+            uint32_t stratum = sequence::permute(s, pattern_size, static_cast<uint32_t>(key));
+            return (stratum + sequence::hash_double(s, static_cast<uint32_t>(key >> 32))) / pattern_size;
+        }
+        case sampler_type::sobol:
+        case sampler_type::blue_noise: {
+            uint64_t key = dimension_key(d, 0);
+            uint32_t i = sequence::nested_uniform_scramble(index, static_cast<uint32_t>(key));
+            double u = sequence::owen_scrambled(i, static_cast<uint32_t>(key >> 32));
+            if (type == sampler_type::blue_noise)
+                u = sequence::fract(u + pixel_offset(px, py, d));
+            return u;
+        }
+        default:
+            return gen.next_double();
+    }
+}
+
+inline sample2 sampler::get_2d(int d) {
+    switch (type) {
+        case sampler_type::stratified: {
+            // Jitter in the cells of the grid, the samples take distinct cells in a random order
+            uint32_t s = index % pattern_size;
+            uint64_t key = dimension_key(d, index / pattern_size);
+            uint32_t cell = sequence::permute(s, grid_x * grid_y, static_cast<uint32_t>(key));
+            uint32_t jitter_key = static_cast<uint32_t>(key >> 32);
+            return { (cell % grid_x + sequence::hash_double(s, jitter_key)) / grid_x,
+                     (cell / grid_x + sequence::hash_double(s, jitter_key * 0x711ad6a5u)) / grid_y };
+        }
+        case sampler_type::cmj: {
+            // Reference: Kensler, Correlated Multi-Jittered Sampling, section 4
+            uint32_t m = grid_x, n = grid_y;
+            uint32_t p = static_cast<uint32_t>(dimension_key(d, index / pattern_size));
+            uint32_t s = sequence::permute(index % pattern_size, pattern_size, p * 0x51633e2du);
+            uint32_t sx = sequence::permute(s % m, m, p * 0xa511e9b3u);
+            uint32_t sy = sequence::permute(s / m, n, p * 0x63d83595u);
+            double jx = sequence::hash_double(s, p * 0xa399d265u);
+            double jy = sequence::hash_double(s, p * 0x711ad6a5u);
+            return { (s % m + (sy + jx) / n) / m, (s / m + (sx + jy) / m) / n };
+        }
+        case sampler_type::sobol:
+        case sampler_type::blue_noise: {
+            uint64_t key = dimension_key(d, 0);
+            uint64_t key_v = rng::mix(key);
+            uint32_t i = sequence::nested_uniform_scramble(index, static_cast<uint32_t>(key));
+            sample2 r = {
+                sequence::owen_scrambled(i, static_cast<uint32_t>(key >> 32)),
+                sequence::owen_scrambled(sequence::sobol_1_reversed(i), static_cast<uint32_t>(key_v))
+            };
+            if (type == sampler_type::blue_noise) {
+                r.u = sequence::fract(r.u + pixel_offset(px, py, d));
+                r.v = sequence::fract(r.v + pixel_offset(py, px, d + 1));
+            }
+            return r;
+        }
+        default: {
+            double u = gen.next_double();
+            return { u, gen.next_double() };
+        }
+    }
+}
+
+#endif
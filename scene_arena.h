@@ -0,0 +1,79 @@
+#ifndef SCENE_ARENA_H
+#define SCENE_ARENA_H
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <new>
+#include <utility>
+#include <vector>
+
+// Class for the storage of a scene. Objects, materials and meshes are placed one after another in
+// large blocks and destroyed together, in reverse order of creation, when the arena goes away.
+// Everything else refers to them with plain pointers, so intersecting and shading never touch a
+// reference count. The arena has to outlive every list, accelerator and renderer built over it.
+// Creation is not synchronized; scenes are built on one thread.
+class scene_arena {
+    public:
+        scene_arena() : current(nullptr), used(0), capacity(0), total(0) {}
+        ~scene_arena();
+
+        scene_arena(const scene_arena&) = delete;
+        scene_arena& operator=(const scene_arena&) = delete;
+
+        // Construct a T in the arena
+        template <typename T, typename... Args>
+        T* make(Args&&... args);
+
+        size_t bytes_used() const { return total; }
+
+    private:
+        static const size_t block_size = 64 * 1024;
+
+        struct destructor {
+            void* object;
+            void (*destroy)(void*);
+        };
+
+        std::vector<std::unique_ptr<unsigned char[]>> blocks;
+        std::vector<destructor> destructors;
+        unsigned char* current;
+        size_t used;
+        size_t capacity;
+        size_t total;
+
+        void* allocate(size_t size, size_t alignment);
+};
+
+inline scene_arena::~scene_arena() {
+    for (size_t i = destructors.size(); i-- > 0;)
+        destructors[i].destroy(destructors[i].object);
+}
+
+template <typename T, typename... Args>
+T* scene_arena::make(Args&&... args) {
+    T* object = new (allocate(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+    destructors.push_back({ object, [](void* p) { static_cast<T*>(p)->~T(); } });
+    return object;
+}
+
+// Bump allocation from the current block; requests that do not fit start a new block, at least
+// large enough for the request and its alignment
+inline void* scene_arena::allocate(size_t size, size_t alignment) {
+    uintptr_t base = reinterpret_cast<uintptr_t>(current);
+    size_t offset = static_cast<size_t>(((base + used + alignment - 1) & ~(uintptr_t(alignment) - 1)) - base);
+    if (current == nullptr || offset + size > capacity) {
+        capacity = std::max(static_cast<size_t>(block_size), size + alignment);
+        blocks.emplace_back(new unsigned char[capacity]);
+        current = blocks.back().get();
+        used = 0;
+        base = reinterpret_cast<uintptr_t>(current);
+        offset = static_cast<size_t>(((base + alignment - 1) & ~(uintptr_t(alignment) - 1)) - base);
+    }
+    used = offset + size;
+    total += size;
+    return current + offset;
+}
+
+#endif
@@ -0,0 +1,279 @@
+#ifndef SCENE_CACHE_H
+#define SCENE_CACHE_H
+
+#include "flat_bvh.h"
+#include "mapped_file.h"
+#include "material.h"
+#include "scene_arena.h"
+#include "triangle_mesh.h"
+#include "utility.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <vector>
+
+// Binary cache of a loaded mesh: vertex and index buffers, face edges, material and the flattened bvh.
+// The file is a header followed by the raw arrays, each aligned to 64 bytes, in native byte order.
+// Loading maps the file and lets the mesh read the arrays in place, so the first ray can be traced
+// right away and all render processes of a host share the same physical pages.
+// A cache is used only if the magic, version, node layout and the size and modification time of the
+// source file all match and every index in it is in range; anything else is treated as a miss and the
+// source is loaded again.
+const char scene_cache_magic[8] = { 'M', 'P', '3', 'S', 'C', 'E', 'N', 'E' };
+const uint32_t scene_cache_version = 3;
+const uint32_t scene_cache_alignment = 64;
+
+// Serializable description of the built-in materials with a solid color
+struct material_desc {
+    material_kind kind;
+    float albedo[3];
+    float param;
+};
+
+enum scene_cache_array { cache_px, cache_py, cache_pz, cache_nx, cache_ny, cache_nz,
+    cache_indices, cache_edges, cache_nodes, cache_primitive_indices, cache_array_count };
+
+struct scene_cache_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t node_size;
+    uint64_t source_size;
+    int64_t source_mtime;
+    material_desc material;
+    float object_color[3];
+    uint32_t leaf_size;
+    uint64_t offset[cache_array_count];
+    uint64_t count[cache_array_count];
+};
+
+inline size_t scene_cache_element_size(int array) {
+    switch (array) {
+        case cache_indices: case cache_primitive_indices: return sizeof(uint32_t);
+        case cache_edges: return sizeof(triangle_mesh::face_edges);
+        case cache_nodes: return sizeof(linear_bvh_node);
+        default: return sizeof(float);
+    }
+}
+
+// View of one array of a mapped cache
+template <typename T>
+mapped_array<T> scene_cache_view(const std::shared_ptr<const mapped_file>& file, const scene_cache_header& header, int array) {
+    return mapped_array<T>(file, static_cast<size_t>(header.offset[array]), static_cast<size_t>(header.count[array]));
+}
+
+// Describe a material, materials with textures other than solid colors are not representable
+inline material_desc describe_material(const material* m) {
+    material_desc desc = { material_kind::none, { 0, 0, 0 }, 0 };
+    if (!m)
+        return desc;
+
+    auto solid = [](const shared_ptr<texture>& t) { return dynamic_cast<const solid_color*>(t.get()) != nullptr; };
+    bool representable = false;
+    switch (m->kind()) {
+        case material_kind::default_mat: representable = solid(static_cast<const default_mat&>(*m).albedo); break;
+        case material_kind::lambertian: representable = solid(static_cast<const lambertian&>(*m).albedo); break;
+        case material_kind::metal: representable = solid(static_cast<const metal&>(*m).albedo); break;
+        case material_kind::diffuse_light: representable = solid(static_cast<const diffuse_light&>(*m).emit); break;
+        case material_kind::dielectric:
+            representable = true;
+            desc.param = static_cast<float>(static_cast<const dielectric&>(*m).ir);
+            break;
+        default: break;
+    }
+    if (representable)
+        desc.kind = m->kind();
+
+    if (desc.kind != material_kind::none && desc.kind != material_kind::dielectric) {
+        color c = m->getColor();
+        for (int a = 0; a < 3; a++)
+            desc.albedo[a] = static_cast<float>(c[a]);
+    }
+    return desc;
+}
+
+inline const material* make_material(scene_arena& arena, const material_desc& desc) {
+    color c(desc.albedo[0], desc.albedo[1], desc.albedo[2]);
+    switch (desc.kind) {
+        case material_kind::default_mat: return arena.make<default_mat>(c);
+        case material_kind::lambertian: return arena.make<lambertian>(c);
+        case material_kind::metal: return arena.make<metal>(c);
+        case material_kind::dielectric: return arena.make<dielectric>(desc.param);
+        case material_kind::diffuse_light: return arena.make<diffuse_light>(c);
+        default: return nullptr;
+    }
+}
+
+// True if the mapped arrays form a mesh that can be traced without reading out of bounds: complete
+// faces over existing vertices, normals for all vertices or none, edges for every face, and a bvh whose children follow
+// their parents, whose leaves reference existing faces and which is no deeper than the traversal
+// stacks allow.
+inline bool scene_cache_consistent(const triangle_mesh& mesh) {
+    size_t vertices = mesh.px.size();
+    if (mesh.py.size() != vertices || mesh.pz.size() != vertices)
+        return false;
+    if (!(mesh.nx.empty() && mesh.ny.empty() && mesh.nz.empty())
+        && (mesh.nx.size() != vertices || mesh.ny.size() != vertices || mesh.nz.size() != vertices))
+        return false;
+
+    if (mesh.indices.size() % 3 != 0)
+        return false;
+    for (uint32_t v : mesh.indices) {
+        if (v >= vertices)
+            return false;
+    }
+
+    size_t triangles = mesh.triangle_count();
+    if (mesh.edges.size() != triangles)
+        return false;
+    for (uint32_t t : mesh.tree.primitive_indices) {
+        if (t >= triangles)
+            return false;
+    }
+
+    // Children come after their parent, so one pass in order settles the depth of every node
+    const linear_bvh_node* nodes = mesh.tree.nodes.data();
+    size_t node_count = mesh.tree.nodes.size();
+    size_t primitive_count = mesh.tree.primitive_indices.size();
+    std::vector<uint8_t> depth(node_count, 0);
+    for (size_t i = 0; i < node_count; i++) {
+        const linear_bvh_node& node = nodes[i];
+        if (node.is_leaf()) {
+            if (node.first_primitive > primitive_count || node.count > primitive_count - node.first_primitive)
+                return false;
+            continue;
+        }
+        if (node.axis > 2 || i + 1 >= node_count || node.second_child <= i + 1 || node.second_child >= node_count)
+            return false;
+        if (depth[i] >= flat_bvh_max_depth)
+            return false;
+        uint8_t child_depth = static_cast<uint8_t>(depth[i] + 1);
+        depth[i + 1] = std::max(depth[i + 1], child_depth);
+        depth[node.second_child] = std::max(depth[node.second_child], child_depth);
+    }
+    return true;
+}
+
+// Write the mesh to cache_path, stamped with the signature of source_path. The file is written under
+// a temporary name and renamed, so concurrent readers never see a partial cache.
+inline bool save_scene_cache(const std::string& cache_path, const std::string& source_path, const triangle_mesh& mesh) {
+    scene_cache_header header;
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.magic, scene_cache_magic, sizeof(header.magic));
+    header.version = scene_cache_version;
+    header.node_size = sizeof(linear_bvh_node);
+    if (!file_signature(source_path, header.source_size, header.source_mtime))
+        return false;
+    header.material = describe_material(mesh.mat_ptr);
+    for (int a = 0; a < 3; a++)
+        header.object_color[a] = static_cast<float>(mesh.objectColor[a]);
+    header.leaf_size = 4;
+
+    const void* arrays[cache_array_count] = {
+        mesh.px.data(), mesh.py.data(), mesh.pz.data(), mesh.nx.data(), mesh.ny.data(), mesh.nz.data(),
+        mesh.indices.data(), mesh.edges.data(), mesh.tree.nodes.data(), mesh.tree.primitive_indices.data() };
+    size_t counts[cache_array_count] = {
+        mesh.px.size(), mesh.py.size(), mesh.pz.size(), mesh.nx.size(), mesh.ny.size(), mesh.nz.size(),
+        mesh.indices.size(), mesh.edges.size(), mesh.tree.nodes.size(), mesh.tree.primitive_indices.size() };
+
+    auto align = [](uint64_t x) { return (x + scene_cache_alignment - 1) / scene_cache_alignment * scene_cache_alignment; };
+    uint64_t offset = align(sizeof(header));
+    for (int i = 0; i < cache_array_count; i++) {
+        header.offset[i] = offset;
+        header.count[i] = counts[i];
+        offset = align(offset + counts[i] * scene_cache_element_size(i));
+    }
+
+    std::string temp_path = cache_path + ".tmp";
+    {
+        std::ofstream out(temp_path, std::ios::binary | std::ios::trunc);
+        if (!out)
+            return false;
+
+        const char zeros[scene_cache_alignment] = {};
+        out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        uint64_t written = sizeof(header);
+        for (int i = 0; i < cache_array_count; i++) {
+            out.write(zeros, static_cast<std::streamsize>(header.offset[i] - written));
+            out.write(static_cast<const char*>(arrays[i]), static_cast<std::streamsize>(counts[i] * scene_cache_element_size(i)));
+            written = header.offset[i] + counts[i] * scene_cache_element_size(i);
+        }
+        if (!out) {
+            out.close();
+            std::remove(temp_path.c_str());
+            return false;
+        }
+    }
+
+    // rename replaces an existing file atomically on POSIX, Windows needs it removed first
+    if (std::rename(temp_path.c_str(), cache_path.c_str()) != 0) {
+        std::remove(cache_path.c_str());
+        if (std::rename(temp_path.c_str(), cache_path.c_str()) != 0) {
+            std::remove(temp_path.c_str());
+            return false;
+        }
+    }
+    return true;
+}
+
+// Map cache_path into mesh if it is a valid cache of source_path. The mesh arrays view the mapping.
+// A mesh without a material gets the cached one, made in arena.
+inline bool load_scene_cache(const std::string& cache_path, const std::string& source_path, triangle_mesh& mesh,
+    scene_arena& arena)
+{
+    uint64_t source_size;
+    int64_t source_mtime;
+    if (!file_signature(source_path, source_size, source_mtime))
+        return false;
+
+    uint64_t cache_size;
+    int64_t cache_mtime;
+    if (!file_signature(cache_path, cache_size, cache_mtime) || cache_size < sizeof(scene_cache_header))
+        return false;
+
+    std::shared_ptr<mapped_file> file = make_shared<mapped_file>(cache_path);
+    if (!file->is_open() || file->size() < sizeof(scene_cache_header))
+        return false;
+
+    scene_cache_header header;
+    std::memcpy(&header, file->data(), sizeof(header));
+    if (std::memcmp(header.magic, scene_cache_magic, sizeof(header.magic)) != 0
+        || header.version != scene_cache_version
+        || header.node_size != sizeof(linear_bvh_node)
+        || header.source_size != source_size
+        || header.source_mtime != source_mtime)
+        return false;
+
+    for (int i = 0; i < cache_array_count; i++) {
+        if (header.offset[i] % scene_cache_alignment != 0 || header.offset[i] > file->size()
+            || header.count[i] > (file->size() - header.offset[i]) / scene_cache_element_size(i))
+            return false;
+    }
+
+    std::shared_ptr<const mapped_file> shared = file;
+    mesh.px = scene_cache_view<float>(shared, header, cache_px);
+    mesh.py = scene_cache_view<float>(shared, header, cache_py);
+    mesh.pz = scene_cache_view<float>(shared, header, cache_pz);
+    mesh.nx = scene_cache_view<float>(shared, header, cache_nx);
+    mesh.ny = scene_cache_view<float>(shared, header, cache_ny);
+    mesh.nz = scene_cache_view<float>(shared, header, cache_nz);
+    mesh.indices = scene_cache_view<uint32_t>(shared, header, cache_indices);
+    mesh.edges = scene_cache_view<triangle_mesh::face_edges>(shared, header, cache_edges);
+    mesh.tree = flat_bvh(scene_cache_view<linear_bvh_node>(shared, header, cache_nodes),
+        scene_cache_view<uint32_t>(shared, header, cache_primitive_indices), static_cast<int>(header.leaf_size));
+    if (!scene_cache_consistent(mesh)) {
+        mesh = triangle_mesh(mesh.mat_ptr, mesh.objectColor);
+        return false;
+    }
+    if (mesh.mat_ptr == default_material()) {
+        if (const material* m = make_material(arena, header.material))
+            mesh.mat_ptr = m;
+    }
+    mesh.objectColor = color(header.object_color[0], header.object_color[1], header.object_color[2]);
+    return true;
+}
+
+#endif
@@ -2,26 +2,37 @@
 #define SPHERE_H
 
 #include "hittable.h"
+#include "material.h"
 #include "vec3.h"
 
 // Class for sphere hittable object
 // Reference: Ray Tracing in One Weekend
-class sphere : public hittable {
+class sphere final : public hittable {
 	public:
 		point3 center;
-		double radius;
-		shared_ptr<material> mat_ptr;
+		real radius;
+		const material* mat_ptr;
 
 	public:
-		sphere() {}
-		sphere(point3 cen, double r, shared_ptr<material> m) : center(cen), radius(r), mat_ptr(m) {};
+		sphere() : hittable(primitive_kind::sphere) {}
+		sphere(point3 cen, double r, const material* m) : hittable(primitive_kind::sphere), center(cen), radius(r), mat_ptr(m) {};
 
 		virtual bool hit(
-			const ray& r, double t_min, double t_max, hit_record& rec) const override;
+			const ray& r, real t_min, real t_max, hit_record& rec) const override;
+		virtual bool occluded(const ray& r, real t_min, real t_max) const override;
 		virtual bool bounding_box(double time0, double time1, aabb& output_box) const override;
+		virtual double pdf_value(const point3& o, const vec3& v) const override;
+		virtual vec3 random(const point3& o, const sample2& u) const override;
+		virtual const material* get_material() const override { return mat_ptr; }
+		virtual uint64_t scene_key(uint64_t key) const override {
+			key = scene_key_add(scene_key_add(hittable::scene_key(key), center), radius);
+			return scene_key_add(key, mat_ptr);
+		}
 
 	private:
-		static void get_sphere_uv(const point3& p, double& u, double& v) {
+		bool nearest_root(const ray& r, real t_min, real t_max, real& root) const;
+
+		static void get_sphere_uv(const point3& p, real& u, real& v) {
 			// p: a given point on the sphere of radius one, centered at the origin.
 			// u: returned value [0,1] of angle around the Y axis from X=-1.
 			// v: returned value [0,1] of angle from Y=-1 to Y=+1.
@@ -37,24 +48,40 @@ class sphere : public hittable {
 		}
 };
 
-// Check if ray hit the sphere
-bool sphere::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
+// Nearest distance along r in [t_min, t_max] where it crosses the sphere.
+// The discriminant comes from the distance between the center and the ray's line instead of
+// half_b^2 - a*c, which cancels for small or distant spheres, and the near root is c / q so that
+// neither root is the difference of two close numbers. Matters most with real as float.
+// Reference: Haines et al., Precision Improvements for Ray/Sphere Intersection (Ray Tracing Gems)
+bool sphere::nearest_root(const ray& r, real t_min, real t_max, real& root) const {
 	vec3 oc = r.origin() - center;
 	auto a = r.direction().length_squared();
 	auto half_b = dot(oc, r.direction());
 	auto c = oc.length_squared() - radius * radius;
 
-	auto discriminant = half_b * half_b - a * c;
+	vec3 l = oc - (half_b / a) * r.direction();
+	auto discriminant = a * (radius * radius - l.length_squared());
 	if (discriminant < 0) return false;
-	auto sqrtd = sqrt(discriminant);
+	auto q = -half_b - std::copysign(sqrt(discriminant), half_b);
+	auto near_root = c / q;
+	auto far_root = q / a;
+	if (near_root > far_root) std::swap(near_root, far_root);
 
 	// Find the nearest root that lies in the acceptable range.
-	auto root = (-half_b - sqrtd) / a;
-	if (root < t_min || t_max < root) {
-		root = (-half_b + sqrtd) / a;
-		if (root < t_min || t_max < root)
+	root = near_root;
+	if (!(root >= t_min && root <= t_max)) {
+		root = far_root;
+		if (!(root >= t_min && root <= t_max))
 			return false;
 	}
+	return true;
+}
+
+// Check if ray hit the sphere
+bool sphere::hit(const ray& r, real t_min, real t_max, hit_record& rec) const {
+	real root;
+	if (!nearest_root(r, t_min, t_max, root))
+		return false;
 
 	rec.t = root;
 	rec.p = r.at(rec.t);
@@ -66,6 +93,49 @@ bool sphere::hit(const ray& r, double t_min, double t_max, hit_record& rec) cons
 	return true;
 }
 
+bool sphere::occluded(const ray& r, real t_min, real t_max) const {
+	real root;
+	return nearest_root(r, t_min, t_max, root);
+}
+
+// Solid angle density of sampling the cone of directions that see the sphere from o uniformly
+double sphere::pdf_value(const point3& o, const vec3& v) const {
+	double distance_squared = (center - o).length_squared();
+	if (distance_squared <= radius * radius)
+		return 0.0;
+
+	hit_record rec;
+	if (!hit(ray(o, v), 0.001, infinity, rec))
+		return 0.0;
+
+	auto cos_theta_max = sqrt(1 - radius * radius / distance_squared);
+	auto solid_angle = 2 * pi * (1 - cos_theta_max);
+	return 1 / solid_angle;
+}
+
+// Random direction in the cone of directions from o that see the sphere
+// Reference: Ray Tracing: The Rest of Your Life
+vec3 sphere::random(const point3& o, const sample2& s) const {
+	vec3 direction = center - o;
+	double distance_squared = direction.length_squared();
+	if (distance_squared <= radius * radius)
+		return direction;
+
+	auto r1 = s.u;
+	auto r2 = s.v;
+	auto z = 1 + r2 * (sqrt(1 - radius * radius / distance_squared) - 1);
+	auto phi = 2 * pi * r1;
+	auto x = cos(phi) * sqrt(1 - z * z);
+	auto y = sin(phi) * sqrt(1 - z * z);
+
+	// Orthonormal basis around the direction to the center
+	vec3 w = unit_vector(direction);
+	vec3 a = fabs(w.x()) > 0.9 ? vec3(0, 1, 0) : vec3(1, 0, 0);
+	vec3 v = unit_vector(cross(w, a));
+	vec3 u = cross(w, v);
+	return x * u + y * v + z * w;
+}
+
 // Return bounding box of sphere
 bool sphere::bounding_box(double time0, double time1, aabb& output_box) const {
 	output_box = aabb(
@@ -3,18 +3,30 @@
 
 #include "utility.h"
 
+#include <cstdint>
+
+// Type tag of the built-in textures, see material_kind
+enum class texture_kind : uint32_t { none, solid_color };
+
 // Class for texture abstract class
 // Reference: Ray Tracing: The Next Week
 class texture {
 public:
+    texture(texture_kind k = texture_kind::none) : tag(k) {}
+
+    texture_kind kind() const { return tag; }
+
     virtual color value(double u, double v, const point3& p) const = 0;
+
+private:
+    texture_kind tag;
 };
 
 // Solid color texture, always return single color
-class solid_color : public texture {
+class solid_color final : public texture {
 public:
-    solid_color() {}
-    solid_color(color c) : color_value(c) {}
+    solid_color() : texture(texture_kind::solid_color) {}
+    solid_color(color c) : texture(texture_kind::solid_color), color_value(c) {}
 
     solid_color(double red, double green, double blue)
         : solid_color(color(red, green, blue)) {}
@@ -27,4 +39,11 @@ private:
     color color_value;
 };
 
+// Texture lookup, solid colors without a virtual call
+inline color texture_value(const texture& t, double u, double v, const point3& p) {
+    if (t.kind() == texture_kind::solid_color)
+        return static_cast<const solid_color&>(t).solid_color::value(u, v, p);
+    return t.value(u, v, p);
+}
+
 #endif
\ No newline at end of file
@@ -0,0 +1,201 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Class for a work-stealing thread pool. Every worker owns a task deque: it pops its own work from
+// the back (most recently pushed, still warm in cache) and steals from the front of the other deques
+// once it runs dry, so uneven tiles balance themselves out across cores.
+class thread_pool {
+    public:
+        using task = std::function<void()>;
+
+    private:
+        struct worker_queue {
+            std::mutex lock;
+            std::deque<task> tasks;
+        };
+
+        std::vector<std::unique_ptr<worker_queue>> queues;
+        std::vector<std::thread> workers;
+        std::atomic<int> queued;
+        std::atomic<unsigned> next_queue;
+        std::mutex sleep_lock;
+        std::condition_variable wake;
+        bool stopping;
+
+        // Index of the worker running on the current thread, -1 for threads outside the pool
+        static int& current_worker() {
+            static thread_local int index = -1;
+            return index;
+        }
+
+        static const thread_pool*& current_pool() {
+            static thread_local const thread_pool* pool = nullptr;
+            return pool;
+        }
+
+    public:
+        thread_pool(unsigned thread_count = std::thread::hardware_concurrency())
+            : queued(0), next_queue(0), stopping(false)
+        {
+            thread_count = std::max(thread_count, 1u);
+            for (unsigned i = 0; i < thread_count; i++)
+                queues.push_back(std::unique_ptr<worker_queue>(new worker_queue()));
+            for (unsigned i = 0; i < thread_count; i++)
+                workers.emplace_back([this, i]() { worker_loop(static_cast<int>(i)); });
+        }
+
+        ~thread_pool() {
+            {
+                std::lock_guard<std::mutex> guard(sleep_lock);
+                stopping = true;
+            }
+            wake.notify_all();
+            for (auto& worker : workers)
+                worker.join();
+        }
+
+        thread_pool(const thread_pool&) = delete;
+        thread_pool& operator=(const thread_pool&) = delete;
+
+        unsigned size() const { return static_cast<unsigned>(workers.size()); }
+
+        // Push a task on the deque of the calling worker, or spread tasks from outside the pool round-robin
+        void submit(task t) {
+            int self = current_pool() == this ? current_worker() : -1;
+            unsigned q = self >= 0 ? static_cast<unsigned>(self) : next_queue++ % size();
+            {
+                std::lock_guard<std::mutex> guard(queues[q]->lock);
+                queues[q]->tasks.push_back(std::move(t));
+            }
+            queued++;
+            {
+                std::lock_guard<std::mutex> guard(sleep_lock);
+            }
+            wake.notify_one();
+        }
+
+        // Run one queued task on the calling thread. Used by threads that wait on tasks so that nested
+        // fork-join work cannot deadlock the pool.
+        bool run_pending_task() {
+            task t;
+            int self = current_pool() == this ? current_worker() : -1;
+            if (!try_pop(self, t))
+                return false;
+            t();
+            return true;
+        }
+
+        // Shared pool sized to the machine
+        static thread_pool& global() {
+            static thread_pool pool;
+            return pool;
+        }
+
+    private:
+        bool try_pop(int self, task& t) {
+            // Own deque first, newest task first
+            if (self >= 0) {
+                worker_queue& own = *queues[self];
+                std::lock_guard<std::mutex> guard(own.lock);
+                if (!own.tasks.empty()) {
+                    t = std::move(own.tasks.back());
+                    own.tasks.pop_back();
+                    queued--;
+                    return true;
+                }
+            }
+
+            // Steal the oldest task of another worker
+            unsigned n = size();
+            unsigned start = self >= 0 ? static_cast<unsigned>(self) + 1 : 0;
+            for (unsigned k = 0; k < n; k++) {
+                worker_queue& victim = *queues[(start + k) % n];
+                std::lock_guard<std::mutex> guard(victim.lock);
+                if (!victim.tasks.empty()) {
+                    t = std::move(victim.tasks.front());
+                    victim.tasks.pop_front();
+                    queued--;
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        void worker_loop(int index) {
+            current_worker() = index;
+            current_pool() = this;
+
+            while (true) {
+                task t;
+                if (try_pop(index, t)) {
+                    t();
+                    continue;
+                }
+
+                // Sleep until there is something to steal or the pool shuts down
+                std::unique_lock<std::mutex> guard(sleep_lock);
+                wake.wait(guard, [this]() { return stopping || queued > 0; });
+                if (stopping && queued == 0)
+                    return;
+            }
+        }
+};
+
+// Class for a group of tasks on a thread pool that can be waited on as a whole
+class task_group {
+    private:
+        thread_pool& pool;
+        std::atomic<int> pending;
+
+    public:
+        task_group(thread_pool& p) : pool(p), pending(0) {}
+
+        ~task_group() { wait(); }
+
+        template <typename F>
+        void run(F&& f) {
+            pending++;
+            pool.submit([this, f]() mutable {
+                f();
+                pending--;
+            });
+        }
+
+        bool done() const { return pending == 0; }
+
+        // Help with queued work until every task of the group has finished
+        void wait() {
+            while (!done()) {
+                if (!pool.run_pending_task())
+                    std::this_thread::yield();
+            }
+        }
+};
+
+// Run f(begin, end) over [0, n) split into ranges of about grain elements, the calling thread helps
+template <typename F>
+void parallel_for(thread_pool& pool, size_t n, size_t grain, F f) {
+    if (n <= grain) {
+        if (n > 0) f(size_t(0), n);
+        return;
+    }
+    task_group group(pool);
+    for (size_t begin = grain; begin < n; begin += grain) {
+        size_t end = std::min(n, begin + grain);
+        group.run([&f, begin, end]() { f(begin, end); });
+    }
+    f(size_t(0), grain);
+    group.wait();
+}
+
+#endif
@@ -0,0 +1,98 @@
+#ifndef TILE_RENDERER_H
+#define TILE_RENDERER_H
+
+#include "thread_pool.h"
+#include "utility.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <iostream>
+#include <thread>
+#include <vector>
+
+// Class for the in-memory image. Row 0 is the top scanline so the buffer can be written out in order.
+class framebuffer {
+    public:
+        int width;
+        int height;
+        std::vector<color> pixels;
+
+    public:
+        framebuffer(int w, int h) : width(w), height(h), pixels(static_cast<size_t>(w) * h) {}
+
+        color& at(int x, int y) { return pixels[static_cast<size_t>(y) * width + x]; }
+        const color& at(int x, int y) const { return pixels[static_cast<size_t>(y) * width + x]; }
+};
+
+// Rectangle of pixels [x0, x1) x [y0, y1) rendered as one task
+struct tile {
+    int x0, y0;
+    int x1, y1;
+};
+
+// One camera sample of pixel (i, j), in image coordinates with j growing upwards
+struct pixel_sample {
+    int i, j;
+    uint32_t sample;
+};
+
+// Class for rendering an image tile by tile on the work-stealing thread pool
+class tile_renderer {
+    private:
+        int width;
+        int height;
+        int tile_size;
+        std::vector<tile> tiles;
+
+    public:
+        tile_renderer(int w, int h, int size = 16) : width(w), height(h), tile_size(size) {
+            for (int y = 0; y < height; y += tile_size)
+                for (int x = 0; x < width; x += tile_size)
+                    tiles.push_back({ x, y, std::min(x + tile_size, width), std::min(y + tile_size, height) });
+        }
+
+        const std::vector<tile>& get_tiles() const { return tiles; }
+
+        // Run render_tile(tile) for every tile and wait for all of them
+        template <typename F>
+        void for_each_tile(thread_pool& pool, F render_tile) const {
+            std::atomic<int> tiles_done(0);
+            task_group group(pool);
+
+            for (const tile& t : tiles) {
+                group.run([&render_tile, &tiles_done, t]() {
+                    render_tile(t);
+                    tiles_done++;
+                });
+            }
+
+            // Help rendering while reporting progress
+            int reported = -1;
+            while (!group.done()) {
+                if (tiles_done != reported) {
+                    reported = tiles_done;
+                    std::cerr << "\rTiles remaining: " << tiles.size() - reported << ' ' << std::flush;
+                }
+                if (!pool.run_pending_task())
+                    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            }
+            std::cerr << "\rTiles remaining: 0 " << std::flush;
+        }
+
+        // Fill the framebuffer with shade_pixel(i, j), where (i, j) are image coordinates with j
+        // growing upwards like the camera's v coordinate.
+        template <typename F>
+        void render(thread_pool& pool, framebuffer& fb, F shade_pixel) const {
+            for_each_tile(pool, [&fb, &shade_pixel, this](const tile& t) {
+                for (int y = t.y0; y < t.y1; y++) {
+                    int j = height - 1 - y;
+                    for (int i = t.x0; i < t.x1; i++)
+                        fb.at(i, y) = shade_pixel(i, j);
+                }
+            });
+        }
+};
+
+#endif
@@ -2,24 +2,53 @@
 #define TRIANGLE_H
 
 #include "hittable.h"
+#include "material.h"
 #include "vec3.h"
 
+// Ray-triangle test against the edges e1 and e2 from p0, u and v are the barycentric weights of the
+// second and third vertex. The parallel test bounds the cosine between e1 and direction x e2 rather
+// than the raw determinant, so it holds for triangles and directions of any length, and the range
+// tests are written so that NaN fails them.
+// Algorithm reference: CS 419 Lecture: Ray-Triangle Intersection
+inline bool intersect_triangle(const point3& p0, const vec3& e1, const vec3& e2, const ray& r,
+	real t_min, real t_max, real& t, real& u, real& v)
+{
+	vec3 qv = cross(r.direction(), e2);
+	real a = dot(e1, qv);
+	if (a * a <= parallel_cosine * parallel_cosine * e1.length_squared() * qv.length_squared()) return false;
+	real f = 1 / a;
+	vec3 s = r.origin() - p0;
+	u = f * dot(s, qv);
+	if (!(u >= 0)) return false;
+	vec3 rv = cross(s, e1);
+	v = f * dot(r.direction(), rv);
+	if (!(v >= 0 && u + v <= 1)) return false;
+	t = f * dot(e2, rv);
+	return t >= t_min && t <= t_max;
+}
+
 // Class for triangle hittable object
-class triangle : public hittable {
+// The edges from p0 are computed once on construction for the intersection test; set the vertices
+// through the constructor only. Without a material the triangle shades with default_material().
+class triangle final : public hittable {
 	public:
 		point3 p0;
 		point3 p1;
 		point3 p2;
+		vec3 e1;
+		vec3 e2;
 		color objectColor;
+		const material* mat_ptr;
 		vec3 normal_v0;
 		vec3 normal_v1;
 		vec3 normal_v2;
 
 	public:
-		triangle() {}
-		triangle(point3 v0, point3 v1, point3 v2, color c) : p0(v0), p1(v1), p2(v2), objectColor(c) {
-			vec3 e1 = p1 - p0;
-			vec3 e2 = p2 - p0;
+		triangle() : hittable(primitive_kind::triangle), mat_ptr(default_material()) {}
+		triangle(point3 v0, point3 v1, point3 v2, color c, const material* m = nullptr)
+			: hittable(primitive_kind::triangle), p0(v0), p1(v1), p2(v2), e1(v1 - v0), e2(v2 - v0), objectColor(c),
+			mat_ptr(m ? m : default_material())
+		{
 			vec3 normal = cross(e1, e2);
 			normal_v0 = normal;
 			normal_v1 = normal;
@@ -29,53 +58,36 @@ class triangle : public hittable {
 		vec3 getFaceNormal() const;
 
 		virtual bool hit(
-			const ray& r, double t_min, double t_max, hit_record& rec) const override;
+			const ray& r, real t_min, real t_max, hit_record& rec) const override;
+		virtual bool occluded(const ray& r, real t_min, real t_max) const override {
+			real t, u, v;
+			return intersect_triangle(p0, e1, e2, r, t_min, t_max, t, u, v);
+		}
 		virtual bool bounding_box(double time0, double time1, aabb& output_box) const override;
+		virtual uint64_t scene_key(uint64_t key) const override {
+			key = scene_key_add(scene_key_add(scene_key_add(hittable::scene_key(key), p0), p1), p2);
+			key = scene_key_add(scene_key_add(scene_key_add(key, normal_v0), normal_v1), normal_v2);
+			return scene_key_add(scene_key_add(key, objectColor), mat_ptr);
+		}
 };
 
 vec3 triangle::getFaceNormal() const {
-	vec3 e1 = p1 - p0;
-	vec3 e2 = p2 - p0;
 	return cross(e1, e2);
 }
 
 // Check if ray hit the triangle object
-bool triangle::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
-	// Algorithm reference: CS 419 Lecture: Ray-Triangle Intersection
-	vec3 e1 = p1 - p0;
-	vec3 e2 = p2 - p0;
-	vec3 normal = cross(e1, e2);
-	vec3 qv = cross(r.direction(), e2);
-	double a = dot(e1, qv);
-	if (a > -epsilon && a < epsilon) return false;
-	double f = 1 / a;
-	vec3 s = r.origin() - p0;
-	double u = f * dot(s, qv);
-	if (u < 0.0) return false;
-	vec3 rv = cross(s, e1);
-	double v = f * dot(r.direction(), rv);
-	if (v < 0.0 || u + v > 1.0) return false;
-	auto ray_t = f * dot(e2, rv);
-	if (ray_t < t_min || t_max < ray_t) return false;
+bool triangle::hit(const ray& r, real t_min, real t_max, hit_record& rec) const {
+	real ray_t, u, v;
+	if (!intersect_triangle(p0, e1, e2, r, t_min, t_max, ray_t, u, v)) return false;
 
 	rec.t = ray_t;
 	rec.p = r.at(rec.t);
 
-	// Compute barycentric coodinates to compute face normals with per-vertex normals
-	// Algorithm reference: CS 419 Lecture: Ray-Triangle Intersection
-	vec3 bary_e0 = p1 - p2;
-	vec3 bary_e1 = p2 - p0;
-	vec3 bary_e2 = p0 - p1;
-	vec3 d0 = rec.p - p0;
-	vec3 d1 = rec.p - p1;
-	vec3 d2 = rec.p - p2;
-	vec3 bary_n = unit_vector(cross(bary_e1, bary_e0));
-	double bary0 = dot(cross(bary_e0, d1), bary_n) / dot(cross(bary_e1, bary_e0), bary_n);
-	double bary1 = dot(cross(bary_e1, d2), bary_n) / dot(cross(bary_e1, bary_e0), bary_n);
-	double bary2 = dot(cross(bary_e2, d0), bary_n) / dot(cross(bary_e1, bary_e0), bary_n);
-
-	vec3 outward_normal = bary0 * normal_v0 + bary1 * normal_v1 + bary2 * normal_v2;
+	// u and v are the barycentric weights of p1 and p2, interpolate the per-vertex normals with them
+	vec3 outward_normal = unit_vector((1.0 - u - v) * normal_v0 + u * normal_v1 + v * normal_v2);
 	rec.set_face_normal(r, outward_normal);
+	rec.mat_ptr = mat_ptr;
+	rec.objectColor = objectColor;
 	return true;
 }
 
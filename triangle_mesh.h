@@ -0,0 +1,245 @@
+#ifndef TRIANGLE_MESH_H
+#define TRIANGLE_MESH_H
+
+#include "flat_bvh.h"
+#include "hittable.h"
+#include "mapped_file.h"
+#include "material.h"
+#include "triangle.h"
+#include "utility.h"
+
+#include <cstdint>
+#include <vector>
+
+// Class for an indexed triangle mesh hittable object.
+// Vertex positions and normals are stored once per vertex as float arrays (structure of arrays) and
+// faces only hold three vertex indices, so a face costs 12 bytes plus its share of the bvh instead of
+// a whole triangle object. The mesh owns a flattened bvh over its faces and is a single object (one
+// virtual call) for the scene level accelerator.
+// For the intersection test every face also keeps its first corner and two edges, so a test reads one
+// record instead of gathering three vertices through the index buffer.
+class triangle_mesh final : public hittable {
+    public:
+        // First corner of a face and the edges from it to the other two
+        struct face_edges {
+            float p0[3];
+            float e1[3];
+            float e2[3];
+        };
+
+        mapped_array<float> px, py, pz;
+        mapped_array<float> nx, ny, nz;
+        mapped_array<uint32_t> indices;
+        mapped_array<face_edges> edges;
+        const material* mat_ptr;
+        color objectColor;
+        flat_bvh tree;
+
+    public:
+        triangle_mesh() : hittable(primitive_kind::triangle_mesh), mat_ptr(default_material()), objectColor(default_color) {}
+        triangle_mesh(const material* m, color c = default_color)
+            : hittable(primitive_kind::triangle_mesh), mat_ptr(m ? m : default_material()), objectColor(c) {}
+
+        size_t vertex_count() const { return px.size(); }
+        size_t triangle_count() const { return indices.size() / 3; }
+        bool has_normals() const { return !nx.empty(); }
+
+        uint32_t add_vertex(const point3& p) {
+            px.edit().push_back(static_cast<float>(p.x()));
+            py.edit().push_back(static_cast<float>(p.y()));
+            pz.edit().push_back(static_cast<float>(p.z()));
+            return static_cast<uint32_t>(px.size() - 1);
+        }
+
+        void add_triangle(uint32_t i0, uint32_t i1, uint32_t i2) {
+            std::vector<uint32_t>& out = indices.edit();
+            out.push_back(i0);
+            out.push_back(i1);
+            out.push_back(i2);
+        }
+
+        point3 position(uint32_t i) const { return point3(px[i], py[i], pz[i]); }
+        vec3 vertex_normal(uint32_t i) const { return vec3(nx[i], ny[i], nz[i]); }
+
+        vec3 face_normal(size_t face) const;
+        aabb triangle_box(size_t face) const;
+
+        // Average the face normals around every vertex for smooth shading
+        void compute_vertex_normals();
+
+        // Build the face edges and the bvh over the faces, must be called once the buffers are filled
+        void build_accel(thread_pool& pool = thread_pool::global());
+
+        virtual bool hit(
+            const ray& r, real t_min, real t_max, hit_record& rec) const override;
+        virtual bool occluded(const ray& r, real t_min, real t_max) const override;
+        virtual bool find_occluder(const ray& r, real t_min, real t_max, occluder_hint& hint) const override;
+        virtual bool bounding_box(double time0, double time1, aabb& output_box) const override;
+        virtual const material* get_material() const override { return mat_ptr; }
+        virtual uint64_t scene_key(uint64_t key) const override;
+
+        bool face_occluded(size_t face, const ray& r, real t_min, real t_max) const {
+            real t, u, v;
+            return hit_triangle(face, r, t_min, t_max, t, u, v);
+        }
+
+    private:
+        bool hit_triangle(size_t face, const ray& r, real t_min, real t_max,
+            real& t, real& u, real& v) const;
+};
+
+vec3 triangle_mesh::face_normal(size_t face) const {
+    point3 p0 = position(indices[3 * face]);
+    point3 p1 = position(indices[3 * face + 1]);
+    point3 p2 = position(indices[3 * face + 2]);
+    return cross(p1 - p0, p2 - p0);
+}
+
+aabb triangle_mesh::triangle_box(size_t face) const {
+    point3 p0 = position(indices[3 * face]);
+    point3 p1 = position(indices[3 * face + 1]);
+    point3 p2 = position(indices[3 * face + 2]);
+    point3 lo, hi;
+    for (int a = 0; a < 3; a++) {
+        lo.e[a] = std::min(p0[a], std::min(p1[a], p2[a]));
+        hi.e[a] = std::max(p0[a], std::max(p1[a], p2[a]));
+    }
+    return aabb(lo, hi);
+}
+
+// Face normals are left unnormalized, so larger faces weigh more in the average
+void triangle_mesh::compute_vertex_normals() {
+    std::vector<vec3> sums(vertex_count(), vec3(0, 0, 0));
+    for (size_t f = 0; f < triangle_count(); f++) {
+        vec3 n = face_normal(f);
+        sums[indices[3 * f]] += n;
+        sums[indices[3 * f + 1]] += n;
+        sums[indices[3 * f + 2]] += n;
+    }
+
+    std::vector<float> x(vertex_count()), y(vertex_count()), z(vertex_count());
+    for (size_t i = 0; i < sums.size(); i++) {
+        vec3 n = sums[i].length_squared() > 0 ? unit_vector(sums[i]) : sums[i];
+        x[i] = static_cast<float>(n.x());
+        y[i] = static_cast<float>(n.y());
+        z[i] = static_cast<float>(n.z());
+    }
+    nx = std::move(x);
+    ny = std::move(y);
+    nz = std::move(z);
+}
+
+// The faces are then renumbered in the order the leaves reference them, so the faces of a leaf are
+// adjacent in the index buffer and the edges and a leaf test touches as few cache lines as possible.
+void triangle_mesh::build_accel(thread_pool& pool) {
+    std::vector<aabb> boxes(triangle_count());
+    for (size_t f = 0; f < boxes.size(); f++)
+        boxes[f] = triangle_box(f);
+    tree = flat_bvh(boxes, 4, pool);
+
+    std::vector<uint32_t>& order = tree.primitive_indices.edit();
+    std::vector<uint32_t> sorted(indices.size());
+    std::vector<face_edges> faces(order.size());
+    for (size_t slot = 0; slot < order.size(); slot++) {
+        size_t f = order[slot];
+        for (int k = 0; k < 3; k++)
+            sorted[3 * slot + k] = indices[3 * f + k];
+
+        point3 p0 = position(indices[3 * f]);
+        vec3 e1 = position(indices[3 * f + 1]) - p0;
+        vec3 e2 = position(indices[3 * f + 2]) - p0;
+        for (int a = 0; a < 3; a++) {
+            faces[slot].p0[a] = static_cast<float>(p0[a]);
+            faces[slot].e1[a] = static_cast<float>(e1[a]);
+            faces[slot].e2[a] = static_cast<float>(e2[a]);
+        }
+        order[slot] = static_cast<uint32_t>(slot);
+    }
+    indices = std::move(sorted);
+    edges = std::move(faces);
+}
+
+// Ray-triangle test of one face, u and v are the barycentric weights of the second and third vertex
+bool triangle_mesh::hit_triangle(size_t face, const ray& r, real t_min, real t_max,
+    real& t, real& u, real& v) const
+{
+    const face_edges& f = edges[face];
+    return intersect_triangle(point3(f.p0[0], f.p0[1], f.p0[2]), vec3(f.e1[0], f.e1[1], f.e1[2]),
+        vec3(f.e2[0], f.e2[1], f.e2[2]), r, t_min, t_max, t, u, v);
+}
+
+// Find the closest face through the bvh, the hit record is filled once for the winning face only
+bool triangle_mesh::hit(const ray& r, real t_min, real t_max, hit_record& rec) const {
+    size_t closest = 0;
+    real hit_t = 0, hit_u = 0, hit_v = 0;
+
+    bool hit_anything = tree.intersect(r, t_min, t_max, [&](uint32_t face, real t0, real& t1) {
+        real t, u, v;
+        if (!hit_triangle(face, r, t0, t1, t, u, v))
+            return false;
+        t1 = hit_t = t;
+        closest = face;
+        hit_u = u;
+        hit_v = v;
+        return true;
+    });
+    if (!hit_anything)
+        return false;
+
+    rec.t = hit_t;
+    rec.u = hit_u;
+    rec.v = hit_v;
+    rec.p = r.at(rec.t);
+
+    vec3 outward_normal;
+    if (has_normals()) {
+        uint32_t i0 = indices[3 * closest], i1 = indices[3 * closest + 1], i2 = indices[3 * closest + 2];
+        outward_normal = unit_vector((1 - hit_u - hit_v) * vertex_normal(i0) + hit_u * vertex_normal(i1) + hit_v * vertex_normal(i2));
+    }
+    else
+        outward_normal = unit_vector(face_normal(closest));
+    rec.set_face_normal(r, outward_normal);
+    rec.mat_ptr = mat_ptr;
+    rec.objectColor = objectColor;
+    return true;
+}
+
+// Any face in range blocks the ray
+bool triangle_mesh::occluded(const ray& r, real t_min, real t_max) const {
+    return tree.occluded(r, t_min, t_max, [&](uint32_t face) {
+        real t, u, v;
+        return hit_triangle(face, r, t_min, t_max, t, u, v);
+    });
+}
+
+// The hint keeps the blocking face, so the next query tests a single triangle
+bool triangle_mesh::find_occluder(const ray& r, real t_min, real t_max, occluder_hint& hint) const {
+    return tree.occluded(r, t_min, t_max, [&](uint32_t face) {
+        if (!face_occluded(face, r, t_min, t_max))
+            return false;
+        hint.object = this;
+        hint.face = face;
+        return true;
+    });
+}
+
+// Every vertex and face, the vertex data in the same order the mesh was loaded or cached in
+uint64_t triangle_mesh::scene_key(uint64_t key) const {
+    key = scene_key_add(hittable::scene_key(key), static_cast<double>(triangle_count()));
+    for (const mapped_array<float>* a : { &px, &py, &pz, &nx, &ny, &nz }) {
+        for (float x : *a)
+            key = scene_key_add(key, x);
+    }
+    for (uint32_t i : indices)
+        key = scene_key_add(key, static_cast<double>(i));
+    return scene_key_add(scene_key_add(key, mat_ptr), objectColor);
+}
+
+bool triangle_mesh::bounding_box(double time0, double time1, aabb& output_box) const {
+    if (tree.empty())
+        return false;
+    output_box = tree.root_box();
+    return true;
+}
+
+#endif
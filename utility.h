@@ -6,7 +6,7 @@
 #include <limits>
 #include <memory>
 
-#include "vec3.h"
+#include "rng.h"
 
 // Usings
 
@@ -21,12 +21,22 @@ const double db_min = std::numeric_limits<double>::min();
 const double infinity = std::numeric_limits<double>::infinity();
 const double pi = 3.1415926535897932385;
 const double epsilon = 0.00001;
-const color default_color = color(1, 0.65, 0);
 const double transparency_inner = 0.8;
+const int roulette_min_depth = 3;             // Bounces always followed before Russian roulette
+const double roulette_max_survival = 0.95;    // Bright paths in closed scenes still end
+
+// vec3.h uses the constants above, so it is included after them
+#include "vec3.h"
+
+const color default_color = color(1, 0.65, 0);
 
 // Utility Functions
+inline int random_int(rng& gen, int min, int max) {
+    return min + static_cast<int>(gen.next_bounded(static_cast<uint32_t>(max - min + 1)));
+}
+
 inline int random_int(int min, int max) {
-    return min + (rand() % static_cast<int>(max - min + 1));
+    return random_int(thread_rng(), min, max);
 }
 
 inline double degrees_to_radians(double degrees) {
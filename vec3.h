@@ -1,55 +1,170 @@
 #ifndef VEC3_H
 #define	VEC3_H
 
+#include "real.h"
+#include "rng.h"
 #include "utility.h"
 
 #include <cmath>
 #include <iostream>
+#include <limits>
 
 using std::sqrt;
 
+// Lane operations behind vec3. In the SIMD backends a vector fills four lanes, the fourth is kept at
+// zero and never read.
+// Float uses one SSE register. Double uses plain code on three components by default, so a double vec3
+// stays 24 bytes: its registers hold too few lanes to pay for moving the scalar results of dots in and
+// out of them, and the triangle test ran slower. Define RT_SIMD_DOUBLE to try one AVX register when the build targets AVX (and C++17,
+// whose aligned new gives containers of vec3 the 32 byte alignment) or a pair of SSE2 registers.
+// RT_NO_SIMD, or a target without SSE2, selects the plain loops for float too.
+// Every lane does the same IEEE operation in the same order as the scalar code did, so the backend
+// does not change any result.
+#if !defined(RT_NO_SIMD) && (defined(RT_SINGLE_PRECISION) || defined(RT_SIMD_DOUBLE)) \
+    && (defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2))
+#define RT_VEC3_SIMD
+#include <immintrin.h>
+#if !defined(RT_SINGLE_PRECISION) && defined(__AVX__) && (__cplusplus >= 201703L || _MSVC_LANG >= 201703L)
+#define RT_VEC3_AVX
+#endif
+#endif
+
+namespace simd {
+#if defined(RT_VEC3_SIMD) && defined(RT_SINGLE_PRECISION)
+	typedef __m128 lanes;
+	inline lanes set(real x, real y, real z) { return _mm_set_ps(0, z, y, x); }
+	inline lanes broadcast(real t) { return _mm_set1_ps(t); }
+	inline lanes add(lanes a, lanes b) { return _mm_add_ps(a, b); }
+	inline lanes sub(lanes a, lanes b) { return _mm_sub_ps(a, b); }
+	inline lanes mul(lanes a, lanes b) { return _mm_mul_ps(a, b); }
+	inline lanes div(lanes a, lanes b) { return _mm_div_ps(a, b); }
+	inline lanes reciprocal(lanes a) {
+		return _mm_and_ps(_mm_div_ps(_mm_set1_ps(1), a), _mm_castsi128_ps(_mm_set_epi32(0, -1, -1, -1)));
+	}
+	inline lanes negate(lanes a) { return _mm_xor_ps(a, _mm_set1_ps(-0.0f)); }
+	inline real sum3(lanes a) {
+		return (_mm_cvtss_f32(a) + _mm_cvtss_f32(_mm_shuffle_ps(a, a, 1))) + _mm_cvtss_f32(_mm_movehl_ps(a, a));
+	}
+	inline lanes cross(lanes a, lanes b) {
+		lanes a_yzx = _mm_shuffle_ps(a, a, _MM_SHUFFLE(3, 0, 2, 1));
+		lanes b_yzx = _mm_shuffle_ps(b, b, _MM_SHUFFLE(3, 0, 2, 1));
+		lanes a_zxy = _mm_shuffle_ps(a, a, _MM_SHUFFLE(3, 1, 0, 2));
+		lanes b_zxy = _mm_shuffle_ps(b, b, _MM_SHUFFLE(3, 1, 0, 2));
+		return _mm_sub_ps(_mm_mul_ps(a_yzx, b_zxy), _mm_mul_ps(a_zxy, b_yzx));
+	}
+#elif defined(RT_VEC3_AVX)
+	typedef __m256d lanes;
+	inline lanes set(real x, real y, real z) { return _mm256_set_pd(0, z, y, x); }
+	inline lanes broadcast(real t) { return _mm256_set1_pd(t); }
+	inline lanes add(lanes a, lanes b) { return _mm256_add_pd(a, b); }
+	inline lanes sub(lanes a, lanes b) { return _mm256_sub_pd(a, b); }
+	inline lanes mul(lanes a, lanes b) { return _mm256_mul_pd(a, b); }
+	inline lanes div(lanes a, lanes b) { return _mm256_div_pd(a, b); }
+	inline lanes reciprocal(lanes a) { return _mm256_blend_pd(_mm256_div_pd(_mm256_set1_pd(1), a), _mm256_setzero_pd(), 8); }
+	inline lanes negate(lanes a) { return _mm256_xor_pd(a, _mm256_set1_pd(-0.0)); }
+	inline real sum3(lanes a) {
+		__m128d xy = _mm256_castpd256_pd128(a);
+		return (_mm_cvtsd_f64(xy) + _mm_cvtsd_f64(_mm_unpackhi_pd(xy, xy))) + _mm_cvtsd_f64(_mm256_extractf128_pd(a, 1));
+	}
+	inline lanes cross(lanes a, lanes b) {
+		// Within 128 bit halves, AVX has no cheap permute across them
+		__m128d a_xy = _mm256_castpd256_pd128(a), a_zw = _mm256_extractf128_pd(a, 1);
+		__m128d b_xy = _mm256_castpd256_pd128(b), b_zw = _mm256_extractf128_pd(b, 1);
+		__m128d a_yz = _mm_shuffle_pd(a_xy, a_zw, 1), a_xw = _mm_shuffle_pd(a_xy, a_zw, 2);
+		__m128d a_zx = _mm_shuffle_pd(a_zw, a_xy, 0), a_yw = _mm_shuffle_pd(a_xy, a_zw, 3);
+		__m128d b_yz = _mm_shuffle_pd(b_xy, b_zw, 1), b_xw = _mm_shuffle_pd(b_xy, b_zw, 2);
+		__m128d b_zx = _mm_shuffle_pd(b_zw, b_xy, 0), b_yw = _mm_shuffle_pd(b_xy, b_zw, 3);
+		__m128d xy = _mm_sub_pd(_mm_mul_pd(a_yz, b_zx), _mm_mul_pd(a_zx, b_yz));
+		__m128d zw = _mm_sub_pd(_mm_mul_pd(a_xw, b_yw), _mm_mul_pd(a_yw, b_xw));
+		return _mm256_insertf128_pd(_mm256_castpd128_pd256(xy), zw, 1);
+	}
+#elif defined(RT_VEC3_SIMD)
+	struct lanes { __m128d xy, zw; };
+	inline lanes set(real x, real y, real z) { return { _mm_set_pd(y, x), _mm_set_sd(z) }; }
+	inline lanes broadcast(real t) { return { _mm_set1_pd(t), _mm_set1_pd(t) }; }
+	inline lanes add(lanes a, lanes b) { return { _mm_add_pd(a.xy, b.xy), _mm_add_pd(a.zw, b.zw) }; }
+	inline lanes sub(lanes a, lanes b) { return { _mm_sub_pd(a.xy, b.xy), _mm_sub_pd(a.zw, b.zw) }; }
+	inline lanes mul(lanes a, lanes b) { return { _mm_mul_pd(a.xy, b.xy), _mm_mul_pd(a.zw, b.zw) }; }
+	inline lanes div(lanes a, lanes b) { return { _mm_div_pd(a.xy, b.xy), _mm_div_pd(a.zw, b.zw) }; }
+	inline lanes reciprocal(lanes a) { return { _mm_div_pd(_mm_set1_pd(1), a.xy), _mm_div_sd(_mm_set_sd(1), a.zw) }; }
+	inline lanes negate(lanes a) {
+		__m128d sign = _mm_set1_pd(-0.0);
+		return { _mm_xor_pd(a.xy, sign), _mm_xor_pd(a.zw, sign) };
+	}
+	inline real sum3(lanes a) {
+		return (_mm_cvtsd_f64(a.xy) + _mm_cvtsd_f64(_mm_unpackhi_pd(a.xy, a.xy))) + _mm_cvtsd_f64(a.zw);
+	}
+	inline lanes cross(lanes a, lanes b) {
+		// yz, zx and xw, yw pairs, so each half is one product difference
+		__m128d a_yz = _mm_shuffle_pd(a.xy, a.zw, 1), a_xw = _mm_shuffle_pd(a.xy, a.zw, 2);
+		__m128d a_zx = _mm_shuffle_pd(a.zw, a.xy, 0), a_yw = _mm_shuffle_pd(a.xy, a.zw, 3);
+		__m128d b_yz = _mm_shuffle_pd(b.xy, b.zw, 1), b_xw = _mm_shuffle_pd(b.xy, b.zw, 2);
+		__m128d b_zx = _mm_shuffle_pd(b.zw, b.xy, 0), b_yw = _mm_shuffle_pd(b.xy, b.zw, 3);
+		return { _mm_sub_pd(_mm_mul_pd(a_yz, b_zx), _mm_mul_pd(a_zx, b_yz)),
+			_mm_sub_pd(_mm_mul_pd(a_xw, b_yw), _mm_mul_pd(a_yw, b_xw)) };
+	}
+#else
+	// Three plain components, no padding lane: without registers to fill it would only cost memory
+	struct lanes { real x, y, z; };
+	inline lanes set(real x, real y, real z) { return { x, y, z }; }
+	inline lanes broadcast(real t) { return { t, t, t }; }
+	inline lanes add(lanes a, lanes b) { return { a.x + b.x, a.y + b.y, a.z + b.z }; }
+	inline lanes sub(lanes a, lanes b) { return { a.x - b.x, a.y - b.y, a.z - b.z }; }
+	inline lanes mul(lanes a, lanes b) { return { a.x * b.x, a.y * b.y, a.z * b.z }; }
+	inline lanes div(lanes a, lanes b) { return { a.x / b.x, a.y / b.y, a.z / b.z }; }
+	inline lanes reciprocal(lanes a) { return { 1 / a.x, 1 / a.y, 1 / a.z }; }
+	inline lanes negate(lanes a) { return { -a.x, -a.y, -a.z }; }
+	inline real sum3(lanes a) { return a.x + a.y + a.z; }
+	inline lanes cross(lanes a, lanes b) {
+		return set(a.y * b.z - a.z * b.y, a.z * b.x - a.x * b.z, a.x * b.y - a.y * b.x);
+	}
+#endif
+}
+
 // Class for vector calculation.
 // Reference: Ray Tracing in One Weekend
+// The components live in the lanes of simd above, e views the same storage. The SIMD backends pad it
+// to four lanes with e[3] unused; the plain backend keeps three.
 class vec3 {
 	public:
-		double e[3];
+		union {
+			simd::lanes v;
+			real e[sizeof(simd::lanes) / sizeof(real)];
+		};
 
 	public:
-		vec3() : e{ 0,0,0 } {}
-		vec3(double e0, double e1, double e2) : e{ e0,e1,e2 } {}
+		vec3() : v(simd::set(0, 0, 0)) {}
+		vec3(real e0, real e1, real e2) : v(simd::set(e0, e1, e2)) {}
+		explicit vec3(simd::lanes a) : v(a) {}
 
-		double x() const { return e[0]; }
-		double y() const { return e[1]; }
-		double z() const { return e[2]; }
+		real x() const { return e[0]; }
+		real y() const { return e[1]; }
+		real z() const { return e[2]; }
 
-		vec3 operator-() const { return vec3(-e[0], -e[1], -e[2]); }
-		double operator[](int i) const { return e[i]; }
-		double& operator[](int i) { return e[i]; }
+		vec3 operator-() const { return vec3(simd::negate(v)); }
+		real operator[](int i) const { return e[i]; }
+		real& operator[](int i) { return e[i]; }
 
-		vec3& operator+=(const vec3& v) {
-			e[0] += v.e[0];
-			e[1] += v.e[1];
-			e[2] += v.e[2];
+		vec3& operator+=(const vec3& u) {
+			v = simd::add(v, u.v);
 			return *this;
 		}
 
-		vec3& operator*=(const double t) {
-			e[0] *= t;
-			e[1] *= t;
-			e[2] *= t;
+		vec3& operator*=(const real t) {
+			v = simd::mul(v, simd::broadcast(t));
 			return *this;
 		}
 
-		vec3& operator/=(const double t) {
+		vec3& operator/=(const real t) {
 			return *this *= 1 / t;
 		}
 
-		double length() const {
+		real length() const {
 			return sqrt(length_squared());
 		}
 
-		double length_squared() const {
-			return e[0] * e[0] + e[1] * e[1] + e[2] * e[2];
+		real length_squared() const {
+			return simd::sum3(simd::mul(v, v));
 		}
 
 		bool near_zero() const {
@@ -70,77 +185,126 @@ inline std::ostream& operator<<(std::ostream& out, const vec3& v) {
 }
 
 inline vec3 operator+(const vec3& u, const vec3& v) {
-	return vec3(u.e[0] + v.e[0], u.e[1] + v.e[1], u.e[2] + v.e[2]);
+	return vec3(simd::add(u.v, v.v));
 }
 
 inline vec3 operator-(const vec3& u, const vec3& v) {
-	return vec3(u.e[0] - v.e[0], u.e[1] - v.e[1], u.e[2] - v.e[2]);
+	return vec3(simd::sub(u.v, v.v));
 }
 
 inline vec3 operator*(const vec3& u, const vec3& v) {
-	return vec3(u.e[0] * v.e[0], u.e[1] * v.e[1], u.e[2] * v.e[2]);
+	return vec3(simd::mul(u.v, v.v));
 }
 
-inline vec3 operator*(double t, const vec3& v) {
-	return vec3(t * v.e[0], t * v.e[1], t * v.e[2]);
+inline vec3 operator*(real t, const vec3& v) {
+	return vec3(simd::mul(simd::broadcast(t), v.v));
 }
 
-inline vec3 operator*(const vec3& v, double t) {
+inline vec3 operator*(const vec3& v, real t) {
 	return t * v;
 }
 
-inline vec3 operator/(vec3 v, double t) {
+inline vec3 operator/(vec3 v, real t) {
 	return (1 / t) * v;
 }
 
-inline double dot(const vec3& u, const vec3& v) {
-	return u.e[0] * v.e[0]
-		+ u.e[1] * v.e[1]
-		+ u.e[2] * v.e[2];
+// Component-wise reciprocal, the fourth lane stays zero
+inline vec3 reciprocal(const vec3& v) {
+	return vec3(simd::reciprocal(v.v));
+}
+
+inline real dot(const vec3& u, const vec3& v) {
+	return simd::sum3(simd::mul(u.v, v.v));
 }
 
 inline vec3 cross(const vec3& u, const vec3& v) {
-	return vec3(u.e[1] * v.e[2] - u.e[2] * v.e[1],
-		u.e[2] * v.e[0] - u.e[0] * v.e[2],
-		u.e[0] * v.e[1] - u.e[1] * v.e[0]);
+	return vec3(simd::cross(u.v, v.v));
+}
+
+// Normalize with the reciprocal square root estimate of the hardware refined by Newton steps, one
+// for float and two for double (about 44 bits). Trades the last bits for a division and a square
+// root; define RT_FAST_NORMALIZE to use it for every unit_vector call. The estimate takes a float, so
+// squared lengths outside the normal float range take the exact path.
+inline vec3 unit_vector_fast(const vec3& v) {
+	real len2 = v.length_squared();
+#ifdef RT_VEC3_SIMD
+	if (!(len2 >= std::numeric_limits<float>::min() && len2 <= std::numeric_limits<float>::max()))
+		return (1 / sqrt(len2)) * v;
+	real y = _mm_cvtss_f32(_mm_rsqrt_ss(_mm_set_ss(static_cast<float>(len2))));
+	y = y * (real(1.5) - real(0.5) * len2 * y * y);
+#ifndef RT_SINGLE_PRECISION
+	y = y * (real(1.5) - real(0.5) * len2 * y * y);
+#endif
+#else
+	real y = 1 / sqrt(len2);
+#endif
+	return y * v;
 }
 
 inline vec3 unit_vector(vec3 v) {
+#ifdef RT_FAST_NORMALIZE
+	return unit_vector_fast(v);
+#else
 	return v / v.length();
+#endif
 }
 
-inline double random_double() {
+inline double random_double(rng& gen) {
 	// Returns a random real in [0,1).
-	return rand() / (RAND_MAX + 1.0);
+	return gen.next_double();
 }
 
-inline double random_double(double min, double max) {
+inline double random_double(rng& gen, double min, double max) {
 	// Returns a random real in [min,max).
-	return min + (max - min) * random_double();
+	return min + (max - min) * random_double(gen);
+}
+
+inline double random_double() {
+	// Returns a random real in [0,1) from the generator of the calling thread.
+	return random_double(thread_rng());
+}
+
+inline double random_double(double min, double max) {
+	// Returns a random real in [min,max) from the generator of the calling thread.
+	return random_double(thread_rng(), min, max);
 }
 
-vec3 random() {
-	return vec3(random_double(), random_double(), random_double());
+vec3 random(rng& gen) {
+	return vec3(random_double(gen), random_double(gen), random_double(gen));
 }
 
-vec3 random(double min, double max) {
-	return vec3(random_double(min, max), random_double(min, max), random_double(min, max));
+vec3 random(rng& gen, double min, double max) {
+	return vec3(random_double(gen, min, max), random_double(gen, min, max), random_double(gen, min, max));
 }
 
 vec3 reflect(const vec3& v, const vec3& n) {
 	return v - 2 * dot(v, n) * n;
 }
 
-vec3 random_in_unit_sphere() {
+vec3 random_in_unit_sphere(rng& gen) {
 	while (true) {
-		auto p = random(-1, 1);
+		auto p = random(gen, -1, 1);
 		if (p.length_squared() >= 1) continue;
 		return p;
 	}
 }
 
-vec3 random_unit_vector() {
-	return unit_vector(random_in_unit_sphere());
+vec3 random_unit_vector(rng& gen) {
+	return unit_vector(random_in_unit_sphere(gen));
+}
+
+// Cosine weighted direction around the unit normal n, from a point (u1, u2) of the unit square
+// Reference: Duff et al., Building an Orthonormal Basis, Revisited
+inline vec3 cosine_direction(const vec3& n, double u1, double u2) {
+	double sign = std::copysign(1.0, static_cast<double>(n.z()));
+	double a = -1.0 / (sign + n.z());
+	double b = n.x() * n.y() * a;
+	vec3 t(1.0 + sign * n.x() * n.x() * a, sign * b, -sign * n.x());
+	vec3 s(b, sign + n.y() * n.y() * a, -n.y());
+
+	double phi = 2 * pi * u1;
+	double r = std::sqrt(u2);
+	return (r * std::cos(phi)) * t + (r * std::sin(phi)) * s + std::sqrt(1.0 - u2) * n;
 }
 
 vec3 refract(const vec3& uv, const vec3& n, double etai_over_etat) {
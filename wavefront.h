@@ -0,0 +1,312 @@
+#ifndef WAVEFRONT_H
+#define WAVEFRONT_H
+
+#include "camera.h"
+#include "dispatch.h"
+#include "hittable.h"
+#include "hittable_list.h"
+#include "light_sampling.h"
+#include "material.h"
+#include "sampler.h"
+#include "thread_pool.h"
+#include "tile_renderer.h"
+#include "utility.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <iostream>
+#include <vector>
+
+// Paths in flight per wave, and paths per task within a stage
+const size_t wavefront_size = 1 << 16;
+const size_t wavefront_grain = 1024;
+
+// Structure of arrays holding the state of every path of a wave
+struct path_states {
+    std::vector<uint32_t> pixel;
+    std::vector<double> ox, oy, oz;
+    std::vector<double> dx, dy, dz;
+    std::vector<double> tr, tg, tb;
+    std::vector<double> lr, lg, lb;
+    std::vector<double> bsdf_pdf;
+    std::vector<int> depth;
+    std::vector<uint8_t> alive;
+    std::vector<sampler> samplers;
+    std::vector<hit_record> hit;
+
+    // Pending light sample of the last shading stage and the factor of the emission it finds
+    std::vector<uint8_t> has_shadow;
+    std::vector<ray> shadow;
+    std::vector<double> wr, wg, wb;
+
+    size_t size() const { return pixel.size(); }
+
+    void resize(size_t n) {
+        pixel.resize(n);
+        ox.resize(n); oy.resize(n); oz.resize(n);
+        dx.resize(n); dy.resize(n); dz.resize(n);
+        tr.resize(n); tg.resize(n); tb.resize(n);
+        lr.resize(n); lg.resize(n); lb.resize(n);
+        bsdf_pdf.resize(n);
+        depth.resize(n);
+        alive.resize(n);
+        samplers.resize(n);
+        hit.resize(n);
+        has_shadow.resize(n);
+        shadow.resize(n);
+        wr.resize(n); wg.resize(n); wb.resize(n);
+    }
+
+    ray get_ray(size_t k) const { return ray(point3(ox[k], oy[k], oz[k]), vec3(dx[k], dy[k], dz[k])); }
+
+    void set_ray(size_t k, const ray& r) {
+        ox[k] = r.origin().x(); oy[k] = r.origin().y(); oz[k] = r.origin().z();
+        dx[k] = r.direction().x(); dy[k] = r.direction().y(); dz[k] = r.direction().z();
+    }
+
+    color throughput(size_t k) const { return color(tr[k], tg[k], tb[k]); }
+
+    void set_throughput(size_t k, const color& c) { tr[k] = c.x(); tg[k] = c.y(); tb[k] = c.z(); }
+
+    void add_radiance(size_t k, const color& c) { lr[k] += c.x(); lg[k] += c.y(); lb[k] += c.z(); }
+
+    // Move the state of path from into slot to. Hits and light samples are not kept, every bounce
+    // makes new ones.
+    void move(size_t to, size_t from) {
+        pixel[to] = pixel[from];
+        ox[to] = ox[from]; oy[to] = oy[from]; oz[to] = oz[from];
+        dx[to] = dx[from]; dy[to] = dy[from]; dz[to] = dz[from];
+        tr[to] = tr[from]; tg[to] = tg[from]; tb[to] = tb[from];
+        lr[to] = lr[from]; lg[to] = lg[from]; lb[to] = lb[from];
+        bsdf_pdf[to] = bsdf_pdf[from];
+        depth[to] = depth[from];
+        alive[to] = alive[from];
+        samplers[to] = samplers[from];
+    }
+};
+
+// Class for rendering in waves of paths instead of one path at a time.
+// Every wave is one sample of a range of pixels. Its paths go through staged kernels until all of them
+// have ended: intersect all paths, sort the hits by material type, shade every material type in its
+// own loop, trace the light samples made while shading, then compact the survivors. Every stage runs
+// in parallel over the paths of the wave.
+// The paths take the same sample values as in the tile renderer and give the same image.
+// Reference: Laine et al., Megakernels Considered Harmful: Wavefront Path Tracing on GPUs
+class wavefront_renderer {
+    private:
+        int width;
+        int height;
+        int samples_per_pixel;
+        int max_depth;
+        color background;
+        const hittable_list& lights;
+        sampler sampling;
+
+        path_states paths;
+        size_t active = 0;
+        std::vector<uint32_t> queue;
+        size_t queue_begin[static_cast<int>(material_kind::count) + 1];
+
+    public:
+        wavefront_renderer(int w, int h, int spp, int depth, const color& bg, const hittable_list& light_list,
+            const sampler& sampler_prototype)
+            : width(w), height(h), samples_per_pixel(spp), max_depth(depth), background(bg), lights(light_list),
+              sampling(sampler_prototype) {}
+
+        void render(thread_pool& pool, framebuffer& fb, const camera& cam, const hittable& world);
+
+    private:
+        void generate(thread_pool& pool, const camera& cam, size_t first_pixel, size_t count, int sample);
+        void intersect(thread_pool& pool, const hittable& world);
+        void sort_by_material();
+        void shade(thread_pool& pool);
+        void trace_shadows(thread_pool& pool, const hittable& world);
+        void compact(framebuffer& fb);
+
+        template <typename M>
+        void shade_queue(thread_pool& pool, material_kind kind);
+};
+
+// Waves cover up to wavefront_size pixels, the samples of a pixel are added in order as in the tile renderer
+void wavefront_renderer::render(thread_pool& pool, framebuffer& fb, const camera& cam, const hittable& world) {
+    size_t pixel_count = static_cast<size_t>(width) * height;
+    paths.resize(std::min(pixel_count, wavefront_size));
+    queue.resize(paths.size());
+
+    size_t waves = (pixel_count + wavefront_size - 1) / wavefront_size * samples_per_pixel;
+    size_t finished = 0;
+    for (size_t first = 0; first < pixel_count; first += wavefront_size) {
+        size_t count = std::min(wavefront_size, pixel_count - first);
+        for (int s = 0; s < samples_per_pixel; s++) {
+            generate(pool, cam, first, count, s);
+            while (active > 0) {
+                intersect(pool, world);
+                sort_by_material();
+                shade(pool);
+                trace_shadows(pool, world);
+                compact(fb);
+            }
+            std::cerr << "\rWaves remaining: " << waves - ++finished << ' ' << std::flush;
+        }
+    }
+}
+
+// Camera rays of one sample for pixels [first_pixel, first_pixel + count)
+void wavefront_renderer::generate(thread_pool& pool, const camera& cam, size_t first_pixel, size_t count, int sample) {
+    active = count;
+    parallel_for(pool, count, wavefront_grain, [&](size_t begin, size_t end) {
+        for (size_t k = begin; k < end; k++) {
+            uint32_t p = static_cast<uint32_t>(first_pixel + k);
+            int i = static_cast<int>(p % width);
+            int j = height - 1 - static_cast<int>(p / width);
+
+            sampler& s = paths.samplers[k];
+            s = sampling;
+            s.start(i, j, sample);
+            sample2 offset = s.pixel_sample();
+            auto u = (i + offset.u) / (width - 1);
+            auto v = (j + offset.v) / (height - 1);
+
+            paths.pixel[k] = p;
+            paths.set_ray(k, cam.get_ray(u, v));
+            paths.tr[k] = paths.tg[k] = paths.tb[k] = 1;
+            paths.lr[k] = paths.lg[k] = paths.lb[k] = 0;
+            paths.bsdf_pdf[k] = 0;
+            paths.depth[k] = 0;
+            paths.alive[k] = 1;
+        }
+    });
+}
+
+// Closest hit of every active path, paths leaving the scene pick up the background and end
+void wavefront_renderer::intersect(thread_pool& pool, const hittable& world) {
+    parallel_for(pool, active, wavefront_grain, [&](size_t begin, size_t end) {
+        for (size_t k = begin; k < end; k++) {
+            paths.has_shadow[k] = 0;
+            if (world.hit(paths.get_ray(k), 0.001, infinity, paths.hit[k]))
+                paths.depth[k]++;
+            else {
+                paths.add_radiance(k, paths.throughput(k) * background);
+                paths.alive[k] = 0;
+            }
+        }
+    });
+}
+
+// Counting sort of the paths with a hit into one queue range per material type
+void wavefront_renderer::sort_by_material() {
+    const int kinds = static_cast<int>(material_kind::count);
+    size_t counts[static_cast<int>(material_kind::count)] = {};
+    for (size_t k = 0; k < active; k++) {
+        if (paths.alive[k])
+            counts[static_cast<int>(paths.hit[k].mat_ptr->kind())]++;
+    }
+
+    queue_begin[0] = 0;
+    for (int m = 0; m < kinds; m++)
+        queue_begin[m + 1] = queue_begin[m] + counts[m];
+
+    size_t next[static_cast<int>(material_kind::count)];
+    std::copy(queue_begin, queue_begin + kinds, next);
+    for (size_t k = 0; k < active; k++) {
+        if (paths.alive[k])
+            queue[next[static_cast<int>(paths.hit[k].mat_ptr->kind())]++] = static_cast<uint32_t>(k);
+    }
+}
+
+void wavefront_renderer::shade(thread_pool& pool) {
+    shade_queue<material>(pool, material_kind::none);
+    shade_queue<default_mat>(pool, material_kind::default_mat);
+    shade_queue<lambertian>(pool, material_kind::lambertian);
+    shade_queue<metal>(pool, material_kind::metal);
+    shade_queue<dielectric>(pool, material_kind::dielectric);
+    shade_queue<diffuse_light>(pool, material_kind::diffuse_light);
+}
+
+// One bounce of every path in the queue of a material type, the same steps as trace_path
+template <typename M>
+void wavefront_renderer::shade_queue(thread_pool& pool, material_kind kind) {
+    size_t first = queue_begin[static_cast<int>(kind)];
+    size_t count = queue_begin[static_cast<int>(kind) + 1] - first;
+
+    parallel_for(pool, count, wavefront_grain, [&](size_t begin, size_t end) {
+        for (size_t q = first + begin; q < first + end; q++) {
+            uint32_t k = queue[q];
+            const hit_record& rec = paths.hit[k];
+            const material& mat = *rec.mat_ptr;
+            color throughput = paths.throughput(k);
+            ray current = paths.get_ray(k);
+
+            color emitted = material_calls<M>::emitted(mat, rec);
+            paths.add_radiance(k, emission_weight(lights, current, rec, paths.bsdf_pdf[k]) * (throughput * emitted));
+            if (paths.depth[k] >= max_depth) {
+                paths.alive[k] = 0;
+                continue;
+            }
+
+            sampler& s = paths.samplers[k];
+            int depth = paths.depth[k];
+            ray scattered;
+            color attenuation;
+            if (!material_calls<M>::scatter(mat, current, rec, attenuation, scattered, s.bsdf_sample(depth))) {
+                paths.alive[k] = 0;
+                continue;
+            }
+
+            // The light sample is traced in its own stage, before the path may end by roulette below
+            paths.bsdf_pdf[k] = material_calls<M>::scatter_pdf(mat, current, rec, scattered);
+            color weight;
+            if (paths.bsdf_pdf[k] > 0 && sample_lights(lights, current, rec, attenuation, s.light_sample(depth), paths.shadow[k], weight)) {
+                color w = throughput * weight;
+                paths.wr[k] = w.x(); paths.wg[k] = w.y(); paths.wb[k] = w.z();
+                paths.has_shadow[k] = 1;
+            }
+
+            throughput = throughput * attenuation;
+
+            double max_throughput = std::max(throughput.x(), std::max(throughput.y(), throughput.z()));
+            if (max_throughput <= 0) {
+                paths.alive[k] = 0;
+                continue;
+            }
+            if (paths.depth[k] >= roulette_min_depth) {
+                double survival = std::min(max_throughput, roulette_max_survival);
+                if (s.roulette_sample(depth) >= survival) {
+                    paths.alive[k] = 0;
+                    continue;
+                }
+                throughput /= survival;
+            }
+
+            paths.set_throughput(k, throughput);
+            paths.set_ray(k, scattered);
+        }
+    });
+}
+
+// Emission found by the light samples of the last shading stage, also of paths that ended in it
+void wavefront_renderer::trace_shadows(thread_pool& pool, const hittable& world) {
+    parallel_for(pool, active, wavefront_grain, [&](size_t begin, size_t end) {
+        for (size_t k = begin; k < end; k++) {
+            if (paths.has_shadow[k])
+                paths.add_radiance(k, color(paths.wr[k], paths.wg[k], paths.wb[k]) * trace_light_sample(world, lights, paths.shadow[k]));
+        }
+    });
+}
+
+// Add the radiance of ended paths to their pixels and move the survivors to the front, in order
+void wavefront_renderer::compact(framebuffer& fb) {
+    size_t kept = 0;
+    for (size_t k = 0; k < active; k++) {
+        if (paths.alive[k]) {
+            if (kept != k)
+                paths.move(kept, k);
+            kept++;
+        }
+        else
+            fb.pixels[paths.pixel[k]] += color(paths.lr[k], paths.lg[k], paths.lb[k]);
+    }
+    active = kept;
+}
+
+#endif
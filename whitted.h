@@ -0,0 +1,183 @@
+#ifndef WHITTED_H
+#define WHITTED_H
+
+#include "bvh4.h"
+#include "camera.h"
+#include "dispatch.h"
+#include "hittable.h"
+#include "light.h"
+#include "material.h"
+#include "ray_packet.h"
+#include "thread_pool.h"
+#include "tile_renderer.h"
+#include "utility.h"
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+// Shading constants of the Phong preview
+struct phong_settings {
+    double ambient;       // Fraction of every light reaching shadowed and unlit surfaces
+    double specular;      // Strength of the highlights
+    double shininess;     // Phong exponent, larger is a smaller highlight
+    int max_depth;        // Mirror and glass bounces followed
+    double shadowed;      // Fraction of the diffuse and specular terms kept where the light is blocked
+};
+
+// A third of the direct light stays in shadow, as the single-light shading before had it
+const phong_settings default_phong = { 0.2, 0.5, 32, 5, 1.0 / 3.0 };
+
+// Class for the last occluder of every light and bounce depth. Neighbouring pixels are mostly shadowed
+// by the same object, or the same face of a mesh, so it is tested before the scene; only a miss pays for
+// the traversal, which records the new occluder. A cache belongs to one thread.
+class shadow_cache {
+    private:
+        std::vector<occluder_hint> hints;
+
+    public:
+        explicit shadow_cache(size_t slots) : hints(slots) {}
+
+        bool occluded(size_t slot, const hittable& world, const ray& r, real t_min, real t_max) {
+            occluder_hint& hint = hints[slot];
+            if (hint_occludes(hint, r, t_min, t_max))
+                return true;
+            return world.find_occluder(r, t_min, t_max, hint);
+        }
+};
+
+// Class for the fast preview: one ray through the center of every pixel, Phong shading under a list of
+// point, directional and spot lights with hard shadows, and Whitted's recursion through mirrors (metal)
+// and glass (dielectric, both the reflected and the refracted ray weighted by Fresnel). Emitters show
+// their emission. Camera rays go through the bvh as 4x4 packets, shadow rays as occlusion queries.
+// Reference: Whitted, An Improved Illumination Model for Shaded Display
+class whitted_renderer {
+    private:
+        const std::vector<light>& lights;
+        color background;
+        phong_settings settings;
+
+    public:
+        whitted_renderer(const std::vector<light>& light_list, const color& bg, const phong_settings& s = default_phong)
+            : lights(light_list), background(bg), settings(s) {}
+
+        // Render one sample per pixel into fb, write it out with a sample count of one
+        void render(thread_pool& pool, const tile_renderer& tiles, framebuffer& fb, const camera& cam, const wide_bvh& world) const;
+
+    private:
+        color trace(const ray& r, const hittable& world, shadow_cache& cache, int depth) const;
+        color shade(const ray& r, const hit_record& rec, const hittable& world, shadow_cache& cache, int depth) const;
+        color phong(const ray& r, const hit_record& rec, const hittable& world, shadow_cache& cache, int depth) const;
+};
+
+void whitted_renderer::render(thread_pool& pool, const tile_renderer& tiles, framebuffer& fb, const camera& cam,
+    const wide_bvh& world) const
+{
+    tiles.for_each_tile(pool, [&](const tile& t) {
+        shadow_cache cache(lights.size() * (settings.max_depth + 1));
+        for (int y0 = t.y0; y0 < t.y1; y0 += 4) {
+            for (int x0 = t.x0; x0 < t.x1; x0 += 4) {
+                int y1 = std::min(y0 + 4, t.y1);
+                int x1 = std::min(x0 + 4, t.x1);
+
+                ray_packet packet;
+                for (int y = y0; y < y1; y++) {
+                    for (int x = x0; x < x1; x++) {
+                        auto u = (x + 0.5) / (fb.width - 1);
+                        auto v = (fb.height - 1 - y + 0.5) / (fb.height - 1);
+                        packet.add(cam.get_ray(u, v));
+                    }
+                }
+
+                hit_record recs[ray_packet::max_size];
+                bool hits[ray_packet::max_size];
+                world.hit_packet(packet, 0.001, infinity, recs, hits);
+
+                int k = 0;
+                for (int y = y0; y < y1; y++) {
+                    for (int x = x0; x < x1; x++, k++)
+                        fb.at(x, y) = hits[k] ? shade(packet.rays[k], recs[k], world, cache, 0) : background;
+                }
+            }
+        }
+    });
+}
+
+color whitted_renderer::trace(const ray& r, const hittable& world, shadow_cache& cache, int depth) const {
+    hit_record rec;
+    if (!world.hit(r, 0.001, infinity, rec))
+        return background;
+    return shade(r, rec, world, cache, depth);
+}
+
+color whitted_renderer::shade(const ray& r, const hit_record& rec, const hittable& world, shadow_cache& cache, int depth) const {
+    const material& mat = *rec.mat_ptr;
+    switch (mat.kind()) {
+        case material_kind::diffuse_light:
+            return dispatch_emitted(rec);
+
+        case material_kind::metal: {
+            if (depth >= settings.max_depth)
+                return color(0, 0, 0);
+            // Mirror reflection, the metal's scatter uses no sample
+            color attenuation;
+            ray reflected;
+            if (!material_calls<metal>::scatter(mat, r, rec, attenuation, reflected, sample2{ 0, 0 }))
+                return color(0, 0, 0);
+            return attenuation * trace(reflected, world, cache, depth + 1);
+        }
+
+        case material_kind::dielectric: {
+            if (depth >= settings.max_depth)
+                return color(0, 0, 0);
+            double ir = static_cast<const dielectric&>(mat).ir;
+            double refraction_ratio = rec.front_face ? (1.0 / ir) : ir;
+            vec3 unit_direction = unit_vector(r.direction());
+            double cos_theta = fmin(dot(-unit_direction, rec.normal), 1.0);
+            double sin_theta = sqrt(1.0 - cos_theta * cos_theta);
+
+            color reflected = trace(ray(rec.p, reflect(unit_direction, rec.normal)), world, cache, depth + 1);
+            if (refraction_ratio * sin_theta > 1.0)
+                return reflected;
+            double kr = schlick_reflectance(cos_theta, refraction_ratio);
+            color refracted = trace(ray(rec.p, refract(unit_direction, rec.normal, refraction_ratio)), world, cache, depth + 1);
+            return kr * reflected + (1 - kr) * refracted;
+        }
+
+        default:
+            return phong(r, rec, world, cache, depth);
+    }
+}
+
+// Ambient, diffuse and specular terms of every light. Lights behind the surface cast no shadow ray, blocked
+// lights keep the shadowed fraction of their diffuse and specular terms.
+color whitted_renderer::phong(const ray& r, const hit_record& rec, const hittable& world, shadow_cache& cache, int depth) const {
+    color object_color = rec.mat_ptr->getColor();
+    vec3 normal = unit_vector(rec.normal);
+    vec3 to_eye = -unit_vector(r.direction());
+
+    color result(0, 0, 0);
+    for (size_t i = 0; i < lights.size(); i++) {
+        vec3 to_light;
+        real distance;
+        color incoming = lights[i].illuminate(rec.p, to_light, distance);
+        result += settings.ambient * lights[i].intensity * object_color;
+
+        double nl_dot = dot(normal, to_light);
+        if (nl_dot <= 0 || incoming.near_zero())
+            continue;
+        if (cache.occluded(depth * lights.size() + i, world, ray(rec.p, to_light), 0.001, distance)) {
+            if (settings.shadowed <= 0)
+                continue;
+            incoming *= settings.shadowed;
+        }
+
+        vec3 reflected = 2 * nl_dot * normal - to_light;
+        double rv_dot = std::max(dot(reflected, to_eye), real(0));
+        result += nl_dot * incoming * object_color;
+        result += (pow(rv_dot, settings.shininess) * settings.specular) * incoming * object_color;
+    }
+    return result;
+}
+
+#endif